@@ -20,9 +20,25 @@
 
 #include "mbed.h"
 #include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationVerifier.h"
 #include "crc.h"
 
-class FragmentationCrc64 {
+#if !defined(__MBED__)
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+/**
+ * CRC64 of a file in flash. Either calculate it in one go, or pass the object to
+ * FragmentationSession::set_verifier and call finish() when the session completes.
+ * Fragments are then hashed as they come in, in any order, and finish() only
+ * reads the fragments that were recovered from redundancy frames.
+ *
+ * As CRC64s of parts of the file can be combined (crc64_combine), fragments or runs
+ * of fragments can also be hashed elsewhere and passed in with update_crc().
+ */
+class FragmentationCrc64 : public FragmentationVerifier {
 public:
     /**
      * Calculate the CRC64 hash of a file in flash
@@ -32,10 +48,16 @@ public:
      * @param buffer_size   The size of the buffer
      */
     FragmentationCrc64(FragmentationBlockDeviceWrapper* flash, uint8_t* buffer, size_t buffer_size)
-        : _flash(flash), _buffer(buffer), _buffer_size(buffer_size)
+        : _flash(flash), _buffer(buffer), _buffer_size(buffer_size),
+          _address(0), _size(0), _fragment_size(0), _fragment_count(0), _next(1),
+          _prefix_crc(0), _crc(0), _hashed(NULL), _hashed_size(0)
     {
     }
 
+    virtual ~FragmentationCrc64() {
+        free(_hashed);
+    }
+
     /**
      * Calculate the CRC64 hash of the file
      *
@@ -45,6 +67,12 @@ public:
      * @returns CRC64 hash of the file
      */
     uint64_t calculate(uint32_t address, size_t size) {
+        // hash straight from the flash if it's mapped into memory
+        const uint8_t* data = _flash->map(address, size);
+        if (data) {
+            return crc64(0, data, size);
+        }
+
         size_t offset = address;
         size_t bytes_left = size;
 
@@ -65,10 +93,224 @@ public:
         return crc;
     }
 
+#if !defined(__MBED__)
+    /**
+     * Calculate the CRC64 hash of the file on several threads. The file is split in a part per thread,
+     * and the CRC64s of the parts are combined. If the flash is mapped into memory the threads hash straight from it,
+     * otherwise every thread reads into a buffer of buffer_size bytes of its own. The block device wrapper is not
+     * thread-safe, so these reads are serialized, and only the hashing runs in parallel.
+     *
+     * @param address   Offset of the file in flash
+     * @param size      Size of the file in flash
+     * @param threads   Number of threads, 0 to use all cores
+     *
+     * @returns CRC64 hash of the file
+     */
+    uint64_t calculate(uint32_t address, size_t size, unsigned int threads) {
+        if (threads == 0) threads = std::thread::hardware_concurrency();
+        if (threads == 0) threads = 1;
+
+        // parts of at least a buffer, so every thread has something to do
+        size_t per_thread = (size + threads - 1) / threads;
+        if (per_thread < _buffer_size) per_thread = _buffer_size;
+        if (threads <= 1 || per_thread >= size) {
+            return calculate(address, size);
+        }
+
+        std::vector<uint64_t> crcs;
+        std::vector<std::thread> workers;
+        std::mutex read_mutex;
+        const uint8_t* data = _flash->map(address, size);
+
+        for (size_t first = 0; first < size; first += per_thread) {
+            crcs.push_back(0);
+        }
+        for (size_t part = 0; part < crcs.size(); part++) {
+            workers.push_back(std::thread([&, part]() {
+                size_t offset = address + (part * per_thread);
+                size_t bytes_left = size - (part * per_thread);
+                if (bytes_left > per_thread) bytes_left = per_thread;
+
+                if (data) {
+                    crcs[part] = crc64(0, data + (part * per_thread), bytes_left);
+                    return;
+                }
+
+                std::vector<uint8_t> buffer(_buffer_size);
+                uint64_t crc = 0;
+                while (bytes_left > 0) {
+                    size_t length = buffer.size();
+                    if (length > bytes_left) length = bytes_left;
+
+                    {
+                        std::lock_guard<std::mutex> lock(read_mutex);
+                        _flash->read(&buffer[0], offset, length);
+                    }
+
+                    crc = crc64(crc, &buffer[0], length);
+
+                    offset += length;
+                    bytes_left -= length;
+                }
+                crcs[part] = crc;
+            }));
+        }
+
+        uint64_t crc = 0;
+        for (size_t part = 0; part < crcs.size(); part++) {
+            workers[part].join();
+
+            size_t length = size - (part * per_thread);
+            if (length > per_thread) length = per_thread;
+            crc = crc64_combine(crc, crcs[part], length);
+        }
+        return crc;
+    }
+#endif
+
+    /**
+     * Start hashing a file while its fragments come in, called by FragmentationSession
+     *
+     * @param address       Offset of the file in flash
+     * @param size          Size of the file in flash
+     * @param fragment_size Size of a fragment
+     *
+     * @returns 0 if succeeded, -1 if the bitmap of hashed fragments could not be allocated
+     */
+    virtual int start(uint32_t address, size_t size, uint8_t fragment_size) {
+        size_t fragment_count = fragment_size ? (size + fragment_size - 1) / fragment_size : 0;
+        size_t hashed_size = (fragment_count + 7) / 8;
+
+        if (hashed_size > _hashed_size) {
+            uint8_t* hashed = (uint8_t*)realloc(_hashed, hashed_size);
+            if (!hashed) return -1;
+
+            _hashed = hashed;
+            _hashed_size = hashed_size;
+        }
+        if (_hashed) {
+            memset(_hashed, 0, _hashed_size);
+        }
+
+        _address = address;
+        _size = size;
+        _fragment_size = fragment_size;
+        _fragment_count = fragment_count;
+        _next = 1;
+        _prefix_crc = 0;
+        _crc = 0;
+        return 0;
+    }
+
+    /**
+     * Hash a fragment that was written to flash, called by FragmentationSession
+     *
+     * @param index     The index of the fragment, 1-based
+     * @param buffer    The contents of the fragment
+     */
+    virtual void update(uint16_t index, const uint8_t* buffer) {
+        if (index < 1 || index > _fragment_count || is_hashed(index - 1)) return;
+
+        set_hashed(index - 1);
+
+        size_t offset = (index - 1) * _fragment_size;
+        size_t length = get_length(offset, _fragment_size);
+
+        // the in-order prefix is hashed as is, other fragments are moved to their place in the file
+        if (index == _next) {
+            _prefix_crc = crc64(_prefix_crc, buffer, length);
+            _next++;
+        }
+        else {
+            _crc ^= crc64_shift(crc64(0, buffer, length), _size - offset - length);
+        }
+    }
+
+    /**
+     * Add the CRC64 of a run of fragments that was hashed elsewhere, e.g. on another thread.
+     * Runs can be added in any order, also mixed with update(). A run that overlaps with
+     * fragments that were already hashed is ignored.
+     *
+     * @param index     The index of the first fragment of the run, 1-based
+     * @param count     Number of fragments in the run
+     * @param crc       CRC64 of the run (starting from 0), the last fragment of the file
+     *                  only counts up to the size of the file
+     */
+    void update_crc(uint16_t index, uint16_t count, uint64_t crc) {
+        if (index < 1 || count == 0 || (size_t)(index - 1) + count > _fragment_count) return;
+
+        size_t first = index - 1;
+        for (size_t ix = first; ix < first + count; ix++) {
+            if (is_hashed(ix)) return;
+        }
+        for (size_t ix = first; ix < first + count; ix++) {
+            set_hashed(ix);
+        }
+
+        size_t offset = first * _fragment_size;
+        size_t length = get_length(offset, count * _fragment_size);
+
+        if (index == _next) {
+            _prefix_crc = crc64_combine(_prefix_crc, crc, length);
+            _next += count;
+        }
+        else {
+            _crc ^= crc64_shift(crc, _size - offset - length);
+        }
+    }
+
+    /**
+     * Finish the CRC64 hash that was started by a session, after it returned FRAG_COMPLETE.
+     * Only the fragments that were not passed to update() are read from flash.
+     *
+     * @returns CRC64 hash of the file
+     */
+    uint64_t finish() {
+        for (size_t ix = 0; ix < _fragment_count; ) {
+            if (is_hashed(ix)) {
+                ix++;
+                continue;
+            }
+
+            // run of fragments that were not seen
+            size_t end = ix + 1;
+            while (end < _fragment_count && !is_hashed(end)) end++;
+
+            size_t offset = ix * _fragment_size;
+            update_crc(ix + 1, end - ix, calculate(_address + offset, get_length(offset, (end - ix) * _fragment_size)));
+            ix = end;
+        }
+
+        size_t prefix = get_length(0, (_next - 1) * _fragment_size);
+        return crc64_shift(_prefix_crc, _size - prefix) ^ _crc;
+    }
+
 private:
+    size_t get_length(size_t offset, size_t length) {
+        return offset + length > _size ? _size - offset : length;
+    }
+
+    bool is_hashed(size_t ix) {
+        return _hashed[ix / 8] & (1 << (ix % 8));
+    }
+
+    void set_hashed(size_t ix) {
+        _hashed[ix / 8] |= 1 << (ix % 8);
+    }
+
     FragmentationBlockDeviceWrapper* _flash;
     uint8_t* _buffer;
     size_t _buffer_size;
+
+    uint32_t _address;
+    size_t _size;
+    uint8_t _fragment_size;
+    size_t _fragment_count;
+    size_t _next;           // first fragment after the in-order prefix
+    uint64_t _prefix_crc;   // CRC64 of the in-order prefix
+    uint64_t _crc;          // CRC64 of the other hashed fragments, in their place in the file
+    uint8_t* _hashed;       // bitmap of the fragments that were hashed
+    size_t _hashed_size;
 };
 
 #endif // _MBEDFRAG_FRAGMENTATION_CRC64_H_
@@ -0,0 +1,472 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_FRAGMENTATION_MANIFEST_H_
+#define _MBEDFRAG_FRAGMENTATION_MANIFEST_H_
+
+#if !defined(MBEDTLS_CONFIG_FILE)
+#include "mbedtls/config.h"
+#else
+#include MBEDTLS_CONFIG_FILE
+#endif
+
+#if defined(MBEDTLS_SHA256_C)
+
+/**
+ * Manifest with a SHA256 hash per chunk of a file, so every chunk can be checked on its own.
+ *
+ * Layout (all fields little-endian):
+ *   uint32_t Magic         FRAG_MANIFEST_MAGIC
+ *   uint32_t FileSize      Size of the file
+ *   uint32_t ChunkSize     Size of a chunk, the last chunk can be shorter
+ *   uint32_t ChunkCount    Number of chunks
+ *   uint8_t  Hashes[ChunkCount][32]
+ *
+ * The root of the manifest is the SHA256 hash of all of it (see get_root). Only the root is signed,
+ * e.g. checked with FragmentationEcdsaVerify or FragmentationRsaVerify, and it covers every chunk.
+ */
+
+#include "mbed.h"
+#include "BlockDevice.h"
+#include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationVerifier.h"
+#include "sha256.h"
+
+#if !defined(__MBED__)
+#include <mutex>
+#include <thread>
+#include <vector>
+#endif
+
+#include "mbed_trace.h"
+#undef TRACE_GROUP
+#define TRACE_GROUP "FMNF"
+
+#define FRAG_MANIFEST_MAGIC         0x464d4e46  // "FNMF"
+#define FRAG_MANIFEST_HEADER_SIZE   16
+#define FRAG_MANIFEST_HASH_SIZE     32
+
+enum FragmentationChunkState {
+    FRAG_CHUNK_UNKNOWN,     // not hashed yet
+    FRAG_CHUNK_VERIFIED,    // matches the manifest
+    FRAG_CHUNK_FAILED       // does not match the manifest
+};
+
+/**
+ * Checks the chunks of a file against a manifest. Pass the object to FragmentationSession::set_verifier,
+ * and every chunk of which all fragments came in order is checked as soon as its last fragment comes in,
+ * so a bad chunk is found before the session completes. After FRAG_COMPLETE, finish() reads back and
+ * checks the other chunks, on a host on several threads.
+ *
+ * Without a session, call start() and finish() to check all chunks of a file in flash.
+ */
+class FragmentationManifestVerify : public FragmentationVerifier {
+public:
+    /**
+     * @param flash         Instance of FragmentationBlockDeviceWrapper
+     * @param buffer        A buffer to be used to read into
+     * @param buffer_size   The size of the buffer
+     */
+    FragmentationManifestVerify(FragmentationBlockDeviceWrapper* flash, uint8_t* buffer, size_t buffer_size)
+        : _flash(flash), _buffer(buffer), _buffer_size(buffer_size),
+          _manifest(NULL), _file_size(0), _chunk_size(0), _chunk_count(0),
+          _address(0), _size(0), _fragment_size(0), _position(0), _states(NULL)
+    {
+        mbedtls_sha256_init(&_sha256_ctx);
+    }
+
+    virtual ~FragmentationManifestVerify() {
+        mbedtls_sha256_free(&_sha256_ctx);
+        free(_states);
+    }
+
+    /**
+     * Size of the manifest of a file
+     *
+     * @param file_size     Size of the file
+     * @param chunk_size    Size of a chunk
+     */
+    static size_t get_manifest_size(size_t file_size, size_t chunk_size) {
+        return FRAG_MANIFEST_HEADER_SIZE + (((file_size + chunk_size - 1) / chunk_size) * FRAG_MANIFEST_HASH_SIZE);
+    }
+
+    /**
+     * Calculate the root of a manifest, the hash that is signed
+     *
+     * @param manifest      The manifest
+     * @param size          Size of the manifest
+     * @param output        Receives the SHA256 hash of the manifest
+     */
+    static void get_root(const uint8_t* manifest, size_t size, unsigned char output[32]) {
+        mbedtls_sha256_context ctx;
+
+        mbedtls_sha256_init(&ctx);
+        mbedtls_sha256_starts(&ctx, false /* is224 */);
+        mbedtls_sha256_update(&ctx, manifest, size);
+        mbedtls_sha256_finish(&ctx, output);
+        mbedtls_sha256_free(&ctx);
+    }
+
+    /**
+     * Set the manifest to check against. Check its root (get_root) against the signature first.
+     * Call before the session is initialized.
+     *
+     * @param manifest      The manifest, needs to stay valid while it's used
+     * @param size          Size of the manifest
+     *
+     * @returns 0 if the manifest is well-formed, -1 if not
+     */
+    int set_manifest(const uint8_t* manifest, size_t size) {
+        if (size < FRAG_MANIFEST_HEADER_SIZE || read_u32(manifest) != FRAG_MANIFEST_MAGIC) {
+            tr_warn("Not a manifest");
+            return -1;
+        }
+
+        uint32_t file_size = read_u32(manifest + 4);
+        uint32_t chunk_size = read_u32(manifest + 8);
+        uint32_t chunk_count = read_u32(manifest + 12);
+
+        if (chunk_size == 0 || chunk_count != (file_size + (uint64_t)chunk_size - 1) / chunk_size ||
+                size != get_manifest_size(file_size, chunk_size)) {
+            tr_warn("Manifest is malformed");
+            return -1;
+        }
+
+        _manifest = manifest;
+        _file_size = file_size;
+        _chunk_size = chunk_size;
+        _chunk_count = chunk_count;
+        return 0;
+    }
+
+    /**
+     * Start checking a file while its fragments come in, called by FragmentationSession
+     *
+     * @param address       Offset of the file in flash
+     * @param size          Size of the file in flash, a file that does not match the manifest fails in finish()
+     * @param fragment_size Size of a fragment
+     *
+     * @returns 0 if succeeded, -1 if the chunk states could not be allocated
+     */
+    virtual int start(uint32_t address, size_t size, uint8_t fragment_size) {
+        uint8_t* states = (uint8_t*)realloc(_states, _chunk_count ? _chunk_count : 1);
+        if (!states) return -1;
+
+        _states = states;
+        memset(_states, FRAG_CHUNK_UNKNOWN, _chunk_count);
+
+        _address = address;
+        _size = size;
+        _fragment_size = fragment_size;
+        _position = 0;
+
+        mbedtls_sha256_starts(&_sha256_ctx, false /* is224 */);
+        return 0;
+    }
+
+    /**
+     * Hash a fragment that was written to flash, called by FragmentationSession.
+     * Chunks are hashed while their fragments come in order, after a lost fragment
+     * hashing picks up again at the first chunk that starts in a later fragment.
+     *
+     * @param index     The index of the fragment, 1-based
+     * @param buffer    The contents of the fragment
+     */
+    virtual void update(uint16_t index, const uint8_t* buffer) {
+        if (!_states || _size != _file_size || index < 1) return;
+
+        size_t offset = (index - 1) * _fragment_size;
+        if (offset >= _size || offset < _position) return;
+
+        size_t length = _fragment_size;
+        if (length > _size - offset) length = _size - offset;
+
+        if (offset != _position) {
+            size_t chunk_start = ((offset + _chunk_size - 1) / _chunk_size) * _chunk_size;
+            if (chunk_start >= offset + length) return;
+
+            buffer += chunk_start - offset;
+            length -= chunk_start - offset;
+            _position = chunk_start;
+            mbedtls_sha256_starts(&_sha256_ctx, false /* is224 */);
+        }
+
+        while (length > 0) {
+            size_t chunk = _position / _chunk_size;
+            size_t end = get_chunk_end(chunk);
+
+            size_t n = end - _position;
+            if (n > length) n = length;
+
+            mbedtls_sha256_update(&_sha256_ctx, buffer, n);
+            buffer += n;
+            length -= n;
+            _position += n;
+
+            if (_position == end) {
+                unsigned char hash[32];
+                mbedtls_sha256_finish(&_sha256_ctx, hash);
+                set_state(chunk, hash);
+                mbedtls_sha256_starts(&_sha256_ctx, false /* is224 */);
+            }
+        }
+    }
+
+    /**
+     * Check the chunks that were not checked while the fragments came in, by reading them from flash.
+     * Call after the session returned FRAG_COMPLETE, or after start() to check a file without a session.
+     *
+     * @returns true if all chunks match the manifest
+     */
+    bool finish() {
+        if (!check_size()) return false;
+
+        for (size_t chunk = 0; chunk < _chunk_count; chunk++) {
+            if (_states[chunk] != FRAG_CHUNK_UNKNOWN) continue;
+
+            unsigned char hash[32];
+            hash_chunk(&_sha256_ctx, _buffer, _buffer_size, chunk, hash);
+            set_state(chunk, hash);
+        }
+
+        return get_failed_chunk() < 0;
+    }
+
+#if !defined(__MBED__)
+    /**
+     * Same as finish(), but the chunks are checked on several threads. If the flash is mapped into memory
+     * the threads hash straight from it, otherwise every thread reads into a buffer of buffer_size bytes of its own.
+     * The block device wrapper is not thread-safe, so these reads are serialized, and only the hashing runs in parallel.
+     *
+     * @param threads   Number of threads, 0 to use all cores
+     *
+     * @returns true if all chunks match the manifest
+     */
+    bool finish(unsigned int threads) {
+        if (!check_size()) return false;
+
+        if (threads == 0) threads = std::thread::hardware_concurrency();
+        if (threads <= 1) return finish();
+
+        std::vector<std::thread> workers;
+
+        // every thread takes every threads'th chunk, so the work is spread evenly
+        for (size_t first = 0; first < threads && first < _chunk_count; first++) {
+            workers.push_back(std::thread([&, first]() {
+                std::vector<uint8_t> buffer(_buffer_size);
+                mbedtls_sha256_context ctx;
+                mbedtls_sha256_init(&ctx);
+
+                for (size_t chunk = first; chunk < _chunk_count; chunk += threads) {
+                    if (_states[chunk] != FRAG_CHUNK_UNKNOWN) continue;
+
+                    unsigned char hash[32];
+                    hash_chunk(&ctx, &buffer[0], buffer.size(), chunk, hash);
+                    set_state(chunk, hash);
+                }
+
+                mbedtls_sha256_free(&ctx);
+            }));
+        }
+        for (size_t ix = 0; ix < workers.size(); ix++) {
+            workers[ix].join();
+        }
+
+        return get_failed_chunk() < 0;
+    }
+
+    /**
+     * Create the manifest of a file in memory, e.g. in the tooling that signs an update
+     *
+     * @param file          The file
+     * @param file_size     Size of the file
+     * @param chunk_size    Size of a chunk
+     * @param manifest      Receives the manifest, get_manifest_size() bytes
+     * @param threads       Number of threads, 0 to use all cores
+     */
+    static void create(const uint8_t* file, size_t file_size, size_t chunk_size, uint8_t* manifest, unsigned int threads = 0) {
+        size_t chunk_count = (file_size + chunk_size - 1) / chunk_size;
+
+        write_u32(manifest, FRAG_MANIFEST_MAGIC);
+        write_u32(manifest + 4, file_size);
+        write_u32(manifest + 8, chunk_size);
+        write_u32(manifest + 12, chunk_count);
+
+        if (threads == 0) threads = std::thread::hardware_concurrency();
+        if (threads == 0) threads = 1;
+
+        std::vector<std::thread> workers;
+        for (size_t first = 0; first < threads && first < chunk_count; first++) {
+            workers.push_back(std::thread([=]() {
+                for (size_t chunk = first; chunk < chunk_count; chunk += threads) {
+                    size_t offset = chunk * chunk_size;
+                    size_t length = file_size - offset < chunk_size ? file_size - offset : chunk_size;
+
+                    mbedtls_sha256_context ctx;
+                    mbedtls_sha256_init(&ctx);
+                    mbedtls_sha256_starts(&ctx, false /* is224 */);
+                    mbedtls_sha256_update(&ctx, file + offset, length);
+                    mbedtls_sha256_finish(&ctx, manifest + FRAG_MANIFEST_HEADER_SIZE + (chunk * FRAG_MANIFEST_HASH_SIZE));
+                    mbedtls_sha256_free(&ctx);
+                }
+            }));
+        }
+        for (size_t ix = 0; ix < workers.size(); ix++) {
+            workers[ix].join();
+        }
+    }
+#endif
+
+    /**
+     * State of a chunk
+     *
+     * @param chunk     Index of the chunk, 0-based
+     */
+    FragmentationChunkState get_chunk_state(size_t chunk) {
+        if (!_states || chunk >= _chunk_count) return FRAG_CHUNK_UNKNOWN;
+
+        return (FragmentationChunkState)_states[chunk];
+    }
+
+    /**
+     * First chunk that does not match the manifest, e.g. to abort a session early
+     *
+     * @returns index of the chunk, or -1 if no chunk failed so far
+     */
+    int get_failed_chunk() {
+        if (!_states) return -1;
+
+        for (size_t chunk = 0; chunk < _chunk_count; chunk++) {
+            if (_states[chunk] == FRAG_CHUNK_FAILED) return chunk;
+        }
+        return -1;
+    }
+
+    /**
+     * Number of chunks in the manifest
+     */
+    size_t get_chunk_count() {
+        return _chunk_count;
+    }
+
+private:
+    static uint32_t read_u32(const uint8_t* p) {
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+    }
+
+    static void write_u32(uint8_t* p, uint32_t value) {
+        p[0] = value & 0xff;
+        p[1] = (value >> 8) & 0xff;
+        p[2] = (value >> 16) & 0xff;
+        p[3] = (value >> 24) & 0xff;
+    }
+
+    bool check_size() {
+        if (!_states) return false;
+
+        if (_size != _file_size) {
+            tr_warn("File is %lu bytes, the manifest is for %lu bytes", (unsigned long)_size, (unsigned long)_file_size);
+            return false;
+        }
+        return true;
+    }
+
+    size_t get_chunk_end(size_t chunk) {
+        size_t end = (chunk + 1) * _chunk_size;
+        return end > _file_size ? _file_size : end;
+    }
+
+    void set_state(size_t chunk, const unsigned char hash[32]) {
+        if (memcmp(hash, _manifest + FRAG_MANIFEST_HEADER_SIZE + (chunk * FRAG_MANIFEST_HASH_SIZE), FRAG_MANIFEST_HASH_SIZE) == 0) {
+            _states[chunk] = FRAG_CHUNK_VERIFIED;
+        }
+        else {
+            tr_warn("Chunk %lu does not match the manifest", (unsigned long)chunk);
+            _states[chunk] = FRAG_CHUNK_FAILED;
+        }
+    }
+
+    /**
+     * Read a chunk from flash, or map it, and hash it
+     */
+    void hash_chunk(mbedtls_sha256_context* ctx, uint8_t* buffer, size_t buffer_size, size_t chunk, unsigned char output[32]) {
+        size_t offset = chunk * _chunk_size;
+        size_t bytes_left = get_chunk_end(chunk) - offset;
+
+        mbedtls_sha256_starts(ctx, false /* is224 */);
+
+        // hash straight from the flash if it's mapped into memory
+        const uint8_t* data = map(_address + offset, bytes_left);
+        if (data) {
+            mbedtls_sha256_update(ctx, data, bytes_left);
+            bytes_left = 0;
+        }
+
+        while (bytes_left > 0) {
+            size_t length = buffer_size;
+            if (length > bytes_left) length = bytes_left;
+
+            read(buffer, _address + offset, length);
+
+            mbedtls_sha256_update(ctx, buffer, length);
+
+            offset += length;
+            bytes_left -= length;
+        }
+
+        mbedtls_sha256_finish(ctx, output);
+    }
+
+    int read(uint8_t* buffer, size_t address, size_t length) {
+#if !defined(__MBED__)
+        // finish(threads) reads from several threads, and the wrapper is not thread-safe
+        std::lock_guard<std::mutex> lock(_read_mutex);
+#endif
+        return _flash->read(buffer, address, length);
+    }
+
+    const uint8_t* map(size_t address, size_t length) {
+#if !defined(__MBED__)
+        std::lock_guard<std::mutex> lock(_read_mutex);
+#endif
+        return _flash->map(address, length);
+    }
+
+    FragmentationBlockDeviceWrapper* _flash;
+    uint8_t* _buffer;
+    size_t _buffer_size;
+
+    const uint8_t* _manifest;
+    uint32_t _file_size;
+    uint32_t _chunk_size;
+    uint32_t _chunk_count;
+
+    uint32_t _address;
+    size_t _size;
+    uint8_t _fragment_size;
+    size_t _position;       // end of the data that was hashed, while fragments come in order
+    uint8_t* _states;       // FragmentationChunkState per chunk
+    mbedtls_sha256_context _sha256_ctx;
+
+#if !defined(__MBED__)
+    std::mutex _read_mutex;
+#endif
+};
+
+#endif // defined(MBEDTLS_SHA256_C)
+
+#endif // _MBEDFRAG_FRAGMENTATION_MANIFEST_H_
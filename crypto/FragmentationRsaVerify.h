@@ -32,6 +32,7 @@
 #include "mbed_debug.h"
 
 #include "mbed_trace.h"
+#undef TRACE_GROUP
 #define TRACE_GROUP "FRSA"
 
 class FragmentationRsaVerify {
@@ -28,9 +28,17 @@
 
 #include "mbed.h"
 #include "BlockDevice.h"
+#include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationVerifier.h"
 #include "sha256.h"
 
-class FragmentationSha256 {
+/**
+ * SHA256 hash of a file in flash. Either calculate it in one go, or pass the object to
+ * FragmentationSession::set_verifier and call finish() when the session completes.
+ * The fragments at the start of the file that come in order are then hashed as they come in,
+ * and finish() only reads the rest of the file. Don't call calculate() while a session runs.
+ */
+class FragmentationSha256 : public FragmentationVerifier {
 public:
     /**
      * Calculate the SHA256 hash of a file in flash
@@ -40,7 +48,8 @@ public:
      * @param buffer_size   The size of the buffer
      */
     FragmentationSha256(FragmentationBlockDeviceWrapper* flash, uint8_t* buffer, size_t buffer_size)
-        : _flash(flash), _buffer(buffer), _buffer_size(buffer_size)
+        : _flash(flash), _buffer(buffer), _buffer_size(buffer_size),
+          _address(0), _size(0), _fragment_size(0), _hashed(0)
     {
     }
 
@@ -56,6 +65,72 @@ public:
         mbedtls_sha256_init(&_sha256_ctx);
         mbedtls_sha256_starts(&_sha256_ctx, false /* is224 */);
 
+        hash_flash(address, size);
+
+        mbedtls_sha256_finish(&_sha256_ctx, output);
+        mbedtls_sha256_free(&_sha256_ctx);
+    }
+
+    /**
+     * Start hashing a file while its fragments come in, called by FragmentationSession
+     *
+     * @param address       Offset of the file in flash
+     * @param size          Size of the file in flash
+     * @param fragment_size Size of a fragment
+     *
+     * @returns 0
+     */
+    virtual int start(uint32_t address, size_t size, uint8_t fragment_size) {
+        mbedtls_sha256_init(&_sha256_ctx);
+        mbedtls_sha256_starts(&_sha256_ctx, false /* is224 */);
+
+        _address = address;
+        _size = size;
+        _fragment_size = fragment_size;
+        _hashed = 0;
+        return 0;
+    }
+
+    /**
+     * Hash a fragment that was written to flash if it extends the hashed part of the file,
+     * called by FragmentationSession
+     *
+     * @param index     The index of the fragment, 1-based
+     * @param buffer    The contents of the fragment
+     */
+    virtual void update(uint16_t index, const uint8_t* buffer) {
+        if (_fragment_size == 0 || (size_t)(index - 1) * _fragment_size != _hashed || _hashed >= _size) return;
+
+        size_t length = _fragment_size;
+        if (length > _size - _hashed) length = _size - _hashed;
+
+        mbedtls_sha256_update(&_sha256_ctx, buffer, length);
+        _hashed += length;
+    }
+
+    /**
+     * Finish the SHA256 hash that was started by a session, after it returned FRAG_COMPLETE.
+     * Only the part of the file after the fragments that came in order is read from flash.
+     *
+     * @param output    Receives the SHA256 hash of the file
+     */
+    void finish(unsigned char output[32]) {
+        hash_flash(_address + _hashed, _size - _hashed);
+        _hashed = _size;
+
+        mbedtls_sha256_finish(&_sha256_ctx, output);
+        mbedtls_sha256_free(&_sha256_ctx);
+    }
+
+private:
+    void hash_flash(uint32_t address, size_t size) {
+        // hash straight from the flash if it's mapped into memory
+        const uint8_t* data = _flash->map(address, size);
+        if (data) {
+            mbedtls_sha256_update(&_sha256_ctx, data, size);
+            return;
+        }
+
         size_t offset = address;
         size_t bytes_left = size;
 
@@ -70,16 +145,17 @@ public:
             offset += length;
             bytes_left -= length;
         }
-
-        mbedtls_sha256_finish(&_sha256_ctx, output);
-        mbedtls_sha256_free(&_sha256_ctx);
     }
 
-private:
     FragmentationBlockDeviceWrapper* _flash;
     uint8_t* _buffer;
     size_t _buffer_size;
     mbedtls_sha256_context _sha256_ctx;
+
+    uint32_t _address;
+    size_t _size;
+    uint8_t _fragment_size;
+    size_t _hashed;     // bytes at the start of the file that were hashed by update()
 };
 
 #endif
@@ -24,12 +24,36 @@
  * written in aligned mode, and this way we have a central place where the
  * block alignment happens.
  *
- * Note that this class initializes a buffer that is one page size long, and
- * that access to this buffer is not thread safe.
+ * The wrapper keeps a write-back cache of one or more pages. Writes only go
+ * to the cache, and a page is programmed when it's evicted (least recently
+ * used first) or when 'sync' is called. Consecutive fragments that land in
+ * the same page thus lead to a single program operation. Whole pages are
+ * passed straight to the block device, in a single call and without a copy,
+ * so only the unaligned head and tail of an operation go through the cache.
+ * Call 'sync' before
+ * reading the underlying block device directly, FragmentationSession does
+ * this when a session completes.
+ *
+ * A page is the smallest unit that can be both read and programmed, so it
+ * honours the read and the program size of the block device. The wrapper
+ * never erases by itself; it relies on the flash being erased up front
+ * (see 'erase', and the erase modes of FragmentationSession::initialize)
+ * or on a block device that tolerates reprogramming.
+ *
+ * The cache is allocated on the heap in 'init', unless 'set_cache_buffer'
+ * hands it caller-owned memory (see StaticFragmentationBlockDeviceWrapper).
+ *
+ * If the block device can be read straight from memory (internal flash, or a
+ * file that is mapped into memory) pass its address to 'set_mapping'. 'map'
+ * then gives out pointers into the block device, so large reads (e.g. hashing
+ * the binary) don't need to be copied into a buffer first.
+ *
+ * Note that access to the cache is not thread safe.
  */
 
 #include "mbed.h"
 #include "BlockDevice.h"
+#include "FragmentationStats.h"
 
 #if !defined(FRAG_BLOCK_DEVICE_DEBUG)
 #define frag_debug(...) do {} while(0)
@@ -37,58 +61,117 @@
 #define frag_debug(...) debug(__VA_ARGS__)
 #endif
 
+// Default number of pages in the write-back cache
+#ifndef FRAG_BD_CACHE_PAGES
+#define FRAG_BD_CACHE_PAGES     1
+#endif
+
 enum frag_bd_error {
     BD_ERROR_NO_MEMORY          = -4002,
     BD_ERROR_NOT_INITIALIZED    = -4003,
 };
 
+typedef struct {
+    uint32_t page;          // page in the cache, FRAG_BD_NO_PAGE if unused
+    uint32_t last_used;     // _cache_tick when the page was last accessed
+    bool     dirty;         // page differs from the block device
+    uint8_t* buffer;
+} frag_bd_cache_entry_t;
+
+// Memory that holds a cache of cachePages pages of pageSize bytes, as a constant expression
+#define FRAG_BD_CACHE_SIZE(pageSize, cachePages)    ((size_t)(cachePages) * (sizeof(frag_bd_cache_entry_t) + (pageSize)))
+
 class FragmentationBlockDeviceWrapper {
 public:
 
     /**
      * Wrap a block device for unaligned operations, note that you still need to initialize this class (by calling 'init')
      *
-     * @param bd A block device (can be uninitialized)
+     * @param bd            A block device (can be uninitialized)
+     * @param cache_pages   Number of pages in the write-back cache
      */
-    FragmentationBlockDeviceWrapper(BlockDevice *bd)
-        : _block_device(bd), _page_size(0), _total_size(0), _page_buffer(NULL), _last_page(0xffffffff)
+    FragmentationBlockDeviceWrapper(BlockDevice *bd, uint8_t cache_pages = FRAG_BD_CACHE_PAGES)
+        : _block_device(bd), _page_size(0), _erase_size(0), _total_size(0),
+          _cache_pages(cache_pages ? cache_pages : 1), _cache(NULL), _cache_memory(NULL), _cache_memory_size(0), _cache_owned(false), _cache_tick(0), _mapping(NULL)
     {
-
+#if FRAG_ENABLE_STATS
+        memset(&_stats, 0, sizeof(_stats));
+#endif
     }
 
     ~FragmentationBlockDeviceWrapper() {
-        if (_page_buffer) free(_page_buffer);
+        if (_cache_owned) free(_cache_memory);
+    }
+
+    /**
+     * Use caller-owned memory for the cache instead of allocating it in 'init'. Call before 'init'.
+     *
+     * @param buffer    Memory for the cache, aligned for a pointer. NULL to allocate the cache on the heap.
+     * @param size      Size of the buffer, at least FRAG_BD_CACHE_SIZE(page size, cache_pages) bytes.
+     *                  The page size is a multiple of the read and program size of the block device,
+     *                  'init' returns BD_ERROR_NO_MEMORY if the buffer is too small for it.
+     */
+    void set_cache_buffer(uint8_t *buffer, size_t size) {
+        if (_cache_owned) free(_cache_memory);
+        _cache = NULL;
+        _cache_memory = buffer;
+        _cache_memory_size = buffer ? size : 0;
+        _cache_owned = false;
     }
 
     /**
-     * Initialize the block device and the wrapper, this will allocate one page of memory
+     * Initialize the block device and the wrapper, this will allocate 'cache_pages' pages of memory
+     * (unless 'set_cache_buffer' was called)
      */
     int init() {
         // already initialised
-        if (_page_buffer) return BD_ERROR_OK;
+        if (_cache) return BD_ERROR_OK;
 
         int init_ret = _block_device->init();
         if (init_ret != 0) {
             return init_ret;
         }
 
-        _page_size = _block_device->get_read_size();
+        // smallest size that is a multiple of both the read and the program size
+        bd_size_t read_size = _block_device->get_read_size();
+        bd_size_t program_size = _block_device->get_program_size();
+        _page_size = read_size;
+        while (_page_size % program_size != 0) {
+            _page_size += read_size;
+        }
+
+        _erase_size = _block_device->get_erase_size();
         _total_size = _block_device->size();
 
-        void *buffer = calloc((size_t)_page_size, 1);
-        _page_buffer = static_cast<uint8_t*>(buffer);
-        if (!_page_buffer) {
+        // the entries, followed by the pages
+        size_t cache_size = FRAG_BD_CACHE_SIZE((size_t)_page_size, _cache_pages);
+        if (!_cache_memory) {
+            _cache_memory = static_cast<uint8_t*>(calloc(1, cache_size));
+            if (!_cache_memory) {
+                return BD_ERROR_NO_MEMORY;
+            }
+            _cache_memory_size = cache_size;
+            _cache_owned = true;
+        }
+        else if (_cache_memory_size < cache_size) {
             return BD_ERROR_NO_MEMORY;
         }
 
+        _cache = reinterpret_cast<frag_bd_cache_entry_t*>(_cache_memory);
+        uint8_t *pages = _cache_memory + (_cache_pages * sizeof(frag_bd_cache_entry_t));
+
+        for (size_t ix = 0; ix < _cache_pages; ix++) {
+            _cache[ix].page = FRAG_BD_NO_PAGE;
+            _cache[ix].last_used = 0;
+            _cache[ix].dirty = false;
+            _cache[ix].buffer = pages + (ix * _page_size);
+        }
+
         return BD_ERROR_OK;
     }
 
     int program(const void *a_buffer, bd_addr_t addr, bd_size_t size) {
-        if (!_page_buffer) return BD_ERROR_NOT_INITIALIZED;
-
-        // Q: a 'global' _page_buffer makes this code not thread-safe...
-        // is this a problem? don't really wanna malloc/free in every call
+        if (!_cache) return BD_ERROR_NOT_INITIALIZED;
 
         uint8_t *buffer = (uint8_t*)a_buffer;
 
@@ -98,52 +181,52 @@ public:
         size_t bytes_left = size;
         while (bytes_left > 0) {
             uint32_t page = addr / _page_size; // this gets auto-rounded
-            uint32_t offset = addr % _page_size; // offset from the start of the _page_buffer
-            uint32_t length = _page_size - offset; // number of bytes to write in this _page_buffer
+            uint32_t offset = addr % _page_size; // offset from the start of the page
+            uint32_t length = _page_size - offset; // number of bytes to write in this page
             if (length > bytes_left) length = bytes_left; // don't overflow
 
-            frag_debug("[FBDW] writing to page=%lu, offset=%lu, length=%lu\n", page, offset, length);
+            // aligned span of whole pages, goes straight to the block device
+            if (offset == 0 && bytes_left >= _page_size) {
+                length = (bytes_left / _page_size) * _page_size;
 
-            int r;
+                frag_debug("[FBDW] writing %lu pages from page=%lu\n", length / _page_size, page);
 
-            // retrieve the page first, as we don't want to overwrite the full page
-            if (_last_page != page) {
-                r = _block_device->read(_page_buffer, page * _page_size, _page_size);
-                if (r != 0) return r;
-            }
+                drop_pages(page, length / _page_size);
+
+                FRAG_STATS_ADD(_stats, FlashPrograms, 1);
+                FRAG_STATS_ADD(_stats, BytesProgrammed, length);
 
-            // frag_debug("[FBDW] _page_buffer of page %d is:\n", page);
-            // for (size_t ix = 0; ix < _page_size; ix++) {
-                // frag_debug("%02x ", _page_buffer[ix]);
-            // }
-            // frag_debug("\n");
+                int r = _block_device->program(buffer, addr, length);
+                if (r != 0) return r;
 
-            // now memcpy to the _page_buffer
-            memcpy(_page_buffer + offset, buffer, length);
+                bytes_left -= length;
+                addr += length;
+                buffer += length;
+                continue;
+            }
 
-            // frag_debug("_page_buffer after memcpy is:\n", page);
-            // for (size_t ix = 0; ix < _page_size; ix++) {
-                // frag_debug("%02x ", _page_buffer[ix]);
-            // }
-            // frag_debug("\n");
+            frag_debug("[FBDW] writing to page=%lu, offset=%lu, length=%lu\n", page, offset, length);
 
-            // and write back
-            r = _block_device->program(_page_buffer, page * _page_size, _page_size);
+            // retrieve the page first, as only part of it is overwritten (whole pages take the path above)
+            frag_bd_cache_entry_t *entry;
+            int r = get_page(page, &entry);
             if (r != 0) return r;
 
+            // now memcpy to the cache, it's written back on eviction or sync
+            memcpy(entry->buffer + offset, buffer, length);
+            entry->dirty = true;
+
             // change the page
             bytes_left -= length;
             addr += length;
             buffer += length;
-
-            _last_page = page;
         }
 
         return BD_ERROR_OK;
     }
 
     int read(void *a_buffer, bd_addr_t addr, bd_size_t size) {
-        if (!_page_buffer) return BD_ERROR_NOT_INITIALIZED;
+        if (!_cache) return BD_ERROR_NOT_INITIALIZED;
 
         frag_debug("[FBDW] read addr=%lu size=%d\n", addr, size);
 
@@ -152,37 +235,254 @@ public:
         size_t bytes_left = size;
         while (bytes_left > 0) {
             uint32_t page = addr / _page_size; // this gets auto-rounded
-            uint32_t offset = addr % _page_size; // offset from the start of the _page_buffer
-            uint32_t length = _page_size - offset; // number of bytes to read in this _page_buffer
+            uint32_t offset = addr % _page_size; // offset from the start of the page
+            uint32_t length = _page_size - offset; // number of bytes to read in this page
             if (length > bytes_left) length = bytes_left; // don't overflow
 
-            frag_debug("[FBDW] Reading from page=%lu, offset=%lu, length=%lu\n", page, offset, length);
+            // aligned span of whole pages, read straight from the block device
+            if (offset == 0 && bytes_left >= _page_size) {
+                length = (bytes_left / _page_size) * _page_size;
 
-            if (_last_page != page) {
-                int r = _block_device->read(_page_buffer, page * _page_size, _page_size);
+                frag_debug("[FBDW] Reading %lu pages from page=%lu\n", length / _page_size, page);
+
+                // the block device needs to be up to date for these pages
+                int r = write_back_pages(page, length / _page_size);
                 if (r != 0) return r;
+
+                FRAG_STATS_ADD(_stats, FlashReads, 1);
+                FRAG_STATS_ADD(_stats, BytesRead, length);
+
+                r = _block_device->read(buffer, addr, length);
+                if (r != 0) return r;
+
+                bytes_left -= length;
+                addr += length;
+                buffer += length;
+                continue;
             }
 
+            frag_debug("[FBDW] Reading from page=%lu, offset=%lu, length=%lu\n", page, offset, length);
+
+            frag_bd_cache_entry_t *entry;
+            int r = get_page(page, &entry);
+            if (r != 0) return r;
+
             // copy into the provided buffer
-            memcpy(buffer, _page_buffer + offset, length);
+            memcpy(buffer, entry->buffer + offset, length);
 
             // change the page
             bytes_left -= length;
             addr += length;
             buffer += length;
+        }
+
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Erase all erase sectors that overlap with a region, this includes data
+     * outside of the region if it is not aligned to the erase size.
+     * Cached pages in these sectors are dropped.
+     *
+     * @param addr  Start of the region
+     * @param size  Size of the region
+     */
+    int erase(bd_addr_t addr, bd_size_t size) {
+        if (!_cache) return BD_ERROR_NOT_INITIALIZED;
+        if (size == 0) return BD_ERROR_OK;
+
+        bd_addr_t start = (addr / _erase_size) * _erase_size;
+        bd_addr_t end = ((addr + size + _erase_size - 1) / _erase_size) * _erase_size;
+
+        frag_debug("[FBDW] erase addr=%lu size=%lu\n", start, end - start);
+
+        uint32_t first_page = start / _page_size;
+        drop_pages(first_page, ((end + _page_size - 1) / _page_size) - first_page);
+
+        FRAG_STATS_ADD(_stats, FlashErases, 1);
+        FRAG_STATS_ADD(_stats, BytesErased, end - start);
+
+        return _block_device->erase(start, end - start);
+    }
+
+    /**
+     * Tell the wrapper where the contents of the block device can be read directly from memory,
+     * e.g. the address of a FlashIAPBlockDevice in the address space of the MCU
+     *
+     * @param base  Address of the start of the block device, NULL if it's not mapped
+     */
+    void set_mapping(const void *base) {
+        _mapping = static_cast<const uint8_t*>(base);
+    }
+
+    /**
+     * Get a pointer to a region of the block device, to read it without a copy. Dirty cached
+     * pages in the region are written back first. The pointer is valid until the region is
+     * programmed or erased.
+     *
+     * @param addr  Start of the region
+     * @param size  Size of the region
+     *
+     * @returns Pointer to the region, or NULL if the block device is not mapped (use 'read' instead)
+     */
+    const uint8_t* map(bd_addr_t addr, bd_size_t size) {
+        if (!_cache || !_mapping || addr + size > _total_size) return NULL;
 
-            _last_page = page;
+        if (size > 0) {
+            uint32_t first_page = addr / _page_size;
+            if (write_back_pages(first_page, ((addr + size + _page_size - 1) / _page_size) - first_page) != 0) {
+                return NULL;
+            }
+        }
+
+        FRAG_STATS_ADD(_stats, BytesMapped, size);
+
+        return _mapping + addr;
+    }
+
+    /**
+     * Size of the pages in the cache, a multiple of the read and program size
+     */
+    bd_size_t get_page_size() {
+        return _page_size;
+    }
+
+    /**
+     * Erase size of the underlying block device
+     */
+    bd_size_t get_erase_size() {
+        return _erase_size;
+    }
+
+    /**
+     * Write all dirty pages in the cache back to the block device
+     */
+    int sync() {
+        if (!_cache) return BD_ERROR_NOT_INITIALIZED;
+
+        for (size_t ix = 0; ix < _cache_pages; ix++) {
+            int r = write_back(&_cache[ix]);
+            if (r != 0) return r;
         }
 
         return BD_ERROR_OK;
     }
 
+    /**
+     * Get the operations on the underlying block device since the wrapper was created.
+     * Only the Flash* and Bytes* counters are used. All zeros unless FRAG_ENABLE_STATS is set.
+     */
+    FragmentationStats_t get_statistics() {
+#if FRAG_ENABLE_STATS
+        return _stats;
+#else
+        FragmentationStats_t stats;
+        memset(&stats, 0, sizeof(stats));
+        return stats;
+#endif
+    }
+
 private:
-    BlockDevice*    _block_device;
-    bd_size_t       _page_size;
-    bd_size_t       _total_size;
-    uint8_t*        _page_buffer;
-    uint32_t        _last_page;
+    static const uint32_t FRAG_BD_NO_PAGE = 0xffffffff;
+
+    /**
+     * Find a page in the cache, or load it in place of the least recently used page
+     *
+     * @param page  Page number
+     * @param entry Receives the cache entry
+     */
+    int get_page(uint32_t page, frag_bd_cache_entry_t **entry) {
+        frag_bd_cache_entry_t *victim = &_cache[0];
+
+        _cache_tick++;
+
+        for (size_t ix = 0; ix < _cache_pages; ix++) {
+            if (_cache[ix].page == page) {
+                _cache[ix].last_used = _cache_tick;
+                *entry = &_cache[ix];
+                return BD_ERROR_OK;
+            }
+
+            if (_cache[ix].page == FRAG_BD_NO_PAGE) {
+                victim = &_cache[ix];
+            }
+            else if (victim->page != FRAG_BD_NO_PAGE && _cache[ix].last_used < victim->last_used) {
+                victim = &_cache[ix];
+            }
+        }
+
+        int r = write_back(victim);
+        if (r != 0) return r;
+
+        victim->page = FRAG_BD_NO_PAGE;
+
+        FRAG_STATS_ADD(_stats, FlashReads, 1);
+        FRAG_STATS_ADD(_stats, BytesRead, _page_size);
+
+        r = _block_device->read(victim->buffer, page * _page_size, _page_size);
+        if (r != 0) return r;
+
+        victim->page = page;
+        victim->last_used = _cache_tick;
+        *entry = victim;
+
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Write back the dirty cached pages in a range of pages
+     */
+    int write_back_pages(uint32_t first, uint32_t count) {
+        for (size_t ix = 0; ix < _cache_pages; ix++) {
+            if (_cache[ix].page != FRAG_BD_NO_PAGE && _cache[ix].page >= first && _cache[ix].page - first < count) {
+                int r = write_back(&_cache[ix]);
+                if (r != 0) return r;
+            }
+        }
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Drop the cached pages in a range of pages, without writing them back
+     */
+    void drop_pages(uint32_t first, uint32_t count) {
+        for (size_t ix = 0; ix < _cache_pages; ix++) {
+            if (_cache[ix].page != FRAG_BD_NO_PAGE && _cache[ix].page >= first && _cache[ix].page - first < count) {
+                _cache[ix].page = FRAG_BD_NO_PAGE;
+                _cache[ix].dirty = false;
+            }
+        }
+    }
+
+    int write_back(frag_bd_cache_entry_t *entry) {
+        if (!entry->dirty) return BD_ERROR_OK;
+
+        frag_debug("[FBDW] writing back page=%lu\n", entry->page);
+
+        FRAG_STATS_ADD(_stats, FlashPrograms, 1);
+        FRAG_STATS_ADD(_stats, BytesProgrammed, _page_size);
+
+        int r = _block_device->program(entry->buffer, entry->page * _page_size, _page_size);
+        if (r != 0) return r;
+
+        entry->dirty = false;
+        return BD_ERROR_OK;
+    }
+
+    BlockDevice*            _block_device;
+    bd_size_t               _page_size;
+    bd_size_t               _erase_size;
+    bd_size_t               _total_size;
+    size_t                  _cache_pages;
+    frag_bd_cache_entry_t*  _cache;
+    uint8_t*                _cache_memory;      // entries and pages of the cache
+    size_t                  _cache_memory_size;
+    bool                    _cache_owned;       // _cache_memory was allocated on the heap
+    uint32_t                _cache_tick;
+    const uint8_t*          _mapping;
+#if FRAG_ENABLE_STATS
+    FragmentationStats_t    _stats;
+#endif
 };
 
 #endif // _FRAG_BD_WRAPPER_H_
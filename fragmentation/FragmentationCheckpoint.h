@@ -0,0 +1,234 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_FRAGMENTATION_CHECKPOINT_H
+#define _MBEDFRAG_FRAGMENTATION_CHECKPOINT_H
+
+/**
+ * Append-only journal of records in a reserved region of the block device,
+ * used to checkpoint a fragmentation session so it can be resumed after a reboot.
+ *
+ * A record is a header followed by its payload. The payload is written first,
+ * and the header only after the payload (and everything else in the cache of
+ * the block device wrapper) was synced, so a record that was cut off by a
+ * reset is never seen. Reading stops at the first place without a valid header.
+ *
+ * The region is erased when the journal is reset, so it only ever needs
+ * erased flash to be programmed once.
+ */
+
+#include "mbed.h"
+#include "FragmentationBlockDeviceWrapper.h"
+
+#include "mbed_trace.h"
+#undef TRACE_GROUP
+#define TRACE_GROUP "FCKP"
+
+#define FRAG_CHECKPOINT_MAGIC       0x464b4350 // FKCP
+
+/**
+ * Records that FragmentationSession writes to the journal
+ */
+enum FragCheckpointRecord {
+    FRAG_CHECKPOINT_START       = 1,    // options of the session, first record
+    FRAG_CHECKPOINT_STATE       = 2,    // decoder state that changed since the previous state record
+    FRAG_CHECKPOINT_DECODING    = 3,    // decoding started, the recovered rows in flash are changed from here
+    FRAG_CHECKPOINT_COMPLETE    = 4     // the binary was reconstructed
+};
+
+enum frag_checkpoint_error {
+    FRAG_CHECKPOINT_FULL        = -4101,    // no room for the record, reset the journal
+    FRAG_CHECKPOINT_END         = -4102,    // no more records
+};
+
+typedef struct {
+    uint32_t magic;
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t size;          // size of the payload
+    uint32_t size_check;    // ~size, to catch a header that was not fully written
+} frag_checkpoint_header_t;
+
+class FragmentationCheckpoint {
+public:
+    /**
+     * @param flash     Instance of wrapped BlockDevice
+     * @param offset    Start of the region in flash, preferably aligned to the erase size
+     * @param size      Size of the region
+     */
+    FragmentationCheckpoint(FragmentationBlockDeviceWrapper *flash, size_t offset = 0, size_t size = 0)
+        : _flash(flash), _offset(offset), _size(size), _position(0), _record(0), _record_type(0), _record_size(0), _read_position(0)
+    {
+    }
+
+    /**
+     * Move the journal to another region, call 'reset' or 'rewind' afterwards
+     */
+    void set_region(size_t offset, size_t size) {
+        _offset = offset;
+        _size = size;
+    }
+
+    /**
+     * Size of the region, 0 if no region was set
+     */
+    size_t get_size() {
+        return _size;
+    }
+
+    /**
+     * Erase the region and start an empty journal
+     */
+    int reset() {
+        int r = _flash->erase(_offset, _size);
+        if (r != 0) {
+            tr_warn("Erasing the checkpoint region failed (%d)", r);
+            return r;
+        }
+
+        _position = 0;
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Start a record, the payload is written through 'write'
+     *
+     * @param type  Type of the record
+     */
+    int begin(uint16_t type) {
+        // room for the header of this record, and for one more empty record
+        if (_position + (2 * sizeof(frag_checkpoint_header_t)) > _size) return FRAG_CHECKPOINT_FULL;
+
+        _record = _position;
+        _record_type = type;
+        _record_size = 0;
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Add data to the payload of the current record
+     */
+    int write(const void *data, size_t size) {
+        size_t position = _record + sizeof(frag_checkpoint_header_t) + _record_size;
+
+        // records without payload always fit, so there's room to mark the end of a session
+        if (position + size + sizeof(frag_checkpoint_header_t) > _size) return FRAG_CHECKPOINT_FULL;
+
+        int r = _flash->program(data, _offset + position, size);
+        if (r != 0) return r;
+
+        _record_size += size;
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Finish the current record, after this call it's visible after a reset
+     */
+    int commit() {
+        // the payload, and all other data the record refers to, is on the block device before the header is
+        int r = _flash->sync();
+        if (r != 0) return r;
+
+        frag_checkpoint_header_t header;
+        header.magic = FRAG_CHECKPOINT_MAGIC;
+        header.type = _record_type;
+        header.reserved = 0xffff;
+        header.size = _record_size;
+        header.size_check = ~_record_size;
+
+        r = _flash->program(&header, _offset + _record, sizeof(header));
+        if (r != 0) return r;
+
+        r = _flash->sync();
+        if (r != 0) return r;
+
+        _position = _record + sizeof(header) + _record_size;
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Start reading the journal from the first record
+     */
+    void rewind() {
+        _position = 0;
+        _record_size = 0;
+        _read_position = 0;
+    }
+
+    /**
+     * Move to the next record. After reading the last record, new records are appended after it.
+     *
+     * @param type  Receives the type of the record
+     * @param size  Receives the size of the payload
+     *
+     * @returns 0 if there is a record, FRAG_CHECKPOINT_END if there are no more records
+     */
+    int next(uint16_t *type, uint32_t *size) {
+        if (_position + sizeof(frag_checkpoint_header_t) > _size) return FRAG_CHECKPOINT_END;
+
+        frag_checkpoint_header_t header;
+        int r = _flash->read(&header, _offset + _position, sizeof(header));
+        if (r != 0) return r;
+
+        if (header.magic != FRAG_CHECKPOINT_MAGIC || header.size != (uint32_t)~header.size_check ||
+                _position + sizeof(header) + header.size > _size) {
+            return FRAG_CHECKPOINT_END;
+        }
+
+        _record = _position;
+        _record_size = header.size;
+        _read_position = 0;
+        _position += sizeof(header) + header.size;
+
+        *type = header.type;
+        *size = header.size;
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Read the next bytes of the payload of the current record
+     */
+    int read(void *data, size_t size) {
+        if (_read_position + size > _record_size) return FRAG_CHECKPOINT_END;
+
+        int r = _flash->read(data, _offset + _record + sizeof(frag_checkpoint_header_t) + _read_position, size);
+        if (r != 0) return r;
+
+        _read_position += size;
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Number of bytes in use
+     */
+    size_t get_used() {
+        return _position;
+    }
+
+private:
+    FragmentationBlockDeviceWrapper *_flash;
+    size_t _offset;
+    size_t _size;
+
+    size_t _position;       // end of the last committed record
+    size_t _record;         // start of the current record
+    uint16_t _record_type;
+    size_t _record_size;    // payload size of the current record
+    size_t _read_position;  // read position in the payload of the current record
+};
+
+#endif // _MBEDFRAG_FRAGMENTATION_CHECKPOINT_H
@@ -0,0 +1,330 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_FRAGMENTATION_ENCODER_H
+#define _MBEDFRAG_FRAGMENTATION_ENCODER_H
+
+/**
+ * Host-side LDPC encoder, the counterpart of FragmentationSession. It splits an
+ * image in fragments and calculates the redundancy frames with the same parity
+ * rows as FragmentationMath, so the output can be fed straight into a session.
+ *
+ * The image is read once, in chunks of FRAG_ENCODER_CHUNK_FRAGMENTS fragments.
+ * Every chunk is XOR'ed into all redundancy frames that use it before the next
+ * chunk is read, so only the chunk and the redundancy frames are kept in memory.
+ * The redundancy frames can be spread over multiple threads.
+ *
+ * This class uses the C++11 standard library and is not meant to run on target.
+ */
+
+#include "mbed.h"
+#include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationMath.h"
+#include "FragmentationSession.h"
+#include <stdio.h>
+#include <functional>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include "mbed_trace.h"
+#undef TRACE_GROUP
+#define TRACE_GROUP "FENC"
+
+// Number of fragments that are read from the image at once, a multiple of FRAG_WORD_BITS
+#ifndef FRAG_ENCODER_CHUNK_FRAGMENTS
+#define FRAG_ENCODER_CHUNK_FRAGMENTS    1024
+#endif
+
+// encode() walks the parity rows a word at a time, from the first word of a chunk
+static_assert(FRAG_ENCODER_CHUNK_FRAGMENTS > 0 && FRAG_ENCODER_CHUNK_FRAGMENTS % FRAG_WORD_BITS == 0,
+    "FRAG_ENCODER_CHUNK_FRAGMENTS needs to be a multiple of FRAG_WORD_BITS");
+
+typedef struct {
+    uint8_t  FragmentSize;      // Size of each fragment in bytes, **without the fragindex**
+    uint16_t RedundancyPackets; // Number of redundancy packets to generate
+    uint8_t  Threads;           // Number of threads used to calculate the redundancy packets, 0 to use all cores
+} FragmentationEncoderOpts_t;
+
+class FragmentationEncoder {
+public:
+    /**
+     * Callback that receives the frames, first the uncoded fragments in order, then the redundancy frames.
+     * The index is the same (1-based) index that FragmentationSession::process_frame expects.
+     */
+    typedef std::function<void(uint16_t index, const uint8_t *frame, size_t size)> FrameCallback;
+
+    /**
+     * Set up an encoder
+     * @param opts List of options for the encoder
+     */
+    FragmentationEncoder(FragmentationEncoderOpts_t opts)
+        : _opts(opts), _fragment_count(0), _padding(0)
+    {
+    }
+
+    /**
+     * Encode an image that is in memory
+     *
+     * @param image     The image
+     * @param size      Size of the image
+     * @param cb        Optional callback that receives every frame
+     *
+     * @returns FRAG_OK if succeeded,
+     *          FRAG_SIZE_INCORRECT if the image does not fit in a session with this fragment size,
+     *          FRAG_NO_MEMORY if allocations failed
+     */
+    FragResult encode(const uint8_t *image, size_t size, FrameCallback cb = FrameCallback()) {
+        return encode_stream(size, [image](uint8_t *buffer, size_t offset, size_t length) {
+            memcpy(buffer, image + offset, length);
+            return 0;
+        }, cb);
+    }
+
+    /**
+     * Encode an image from a file, starting at the current position of the file
+     *
+     * @param file      The file
+     * @param size      Number of bytes to read from the file
+     * @param cb        Optional callback that receives every frame
+     *
+     * @returns FRAG_OK if succeeded,
+     *          FRAG_SIZE_INCORRECT if the image does not fit in a session with this fragment size,
+     *          FRAG_NO_MEMORY if allocations failed,
+     *          FRAG_FLASH_READ_ERROR if reading the file failed
+     */
+    FragResult encode(FILE *file, size_t size, FrameCallback cb = FrameCallback()) {
+        return encode_stream(size, [file](uint8_t *buffer, size_t, size_t length) {
+            return fread(buffer, 1, length, file) == length ? 0 : -1;
+        }, cb);
+    }
+
+    /**
+     * Encode a file
+     *
+     * @param path      Path to the file
+     * @param cb        Optional callback that receives every frame
+     *
+     * @returns see encode(FILE*, size_t, FrameCallback)
+     */
+    FragResult encode(const char *path, FrameCallback cb = FrameCallback()) {
+        FILE *file = fopen(path, "rb");
+        if (!file) {
+            tr_warn("Could not open %s", path);
+            return FRAG_FLASH_READ_ERROR;
+        }
+
+        FragResult result = FRAG_FLASH_READ_ERROR;
+        if (fseek(file, 0, SEEK_END) == 0) {
+            long size = ftell(file);
+            if (size >= 0 && fseek(file, 0, SEEK_SET) == 0) {
+                result = encode(file, (size_t)size, cb);
+            }
+        }
+
+        fclose(file);
+        return result;
+    }
+
+    /**
+     * Encode an image that is stored on a block device
+     *
+     * @param flash     Instance of FragmentationBlockDeviceWrapper
+     * @param address   Offset of the image in flash
+     * @param size      Size of the image
+     * @param cb        Optional callback that receives every frame
+     *
+     * @returns see encode(FILE*, size_t, FrameCallback)
+     */
+    FragResult encode(FragmentationBlockDeviceWrapper *flash, size_t address, size_t size, FrameCallback cb = FrameCallback()) {
+        return encode_stream(size, [flash, address](uint8_t *buffer, size_t offset, size_t length) {
+            return flash->read(buffer, address + offset, length);
+        }, cb);
+    }
+
+    /**
+     * Get the options for a FragmentationSession that decodes the last encoded image
+     *
+     * @param flash_offset Place in flash where the decoded image needs to be placed
+     */
+    FragmentationSessionOpts_t get_session_options(size_t flash_offset) {
+        FragmentationSessionOpts_t opts;
+        opts.NumberOfFragments = _fragment_count;
+        opts.FragmentSize = _opts.FragmentSize;
+        opts.Padding = _padding;
+        opts.RedundancyPackets = _opts.RedundancyPackets;
+        opts.FlashOffset = flash_offset;
+        return opts;
+    }
+
+    /**
+     * Get a redundancy frame of the last encoded image
+     *
+     * @param index The frame index, between NumberOfFragments + 1 and NumberOfFragments + RedundancyPackets
+     *
+     * @returns pointer to FragmentSize bytes, or NULL if the index is out of range
+     */
+    const uint8_t *get_redundancy_frame(uint16_t index) {
+        if (index <= _fragment_count || index > _fragment_count + _opts.RedundancyPackets) return NULL;
+        if (_coded.empty()) return NULL;
+
+        return &_coded[(index - _fragment_count - 1) * _opts.FragmentSize];
+    }
+
+    /**
+     * Get the number of uncoded fragments of the last encoded image
+     */
+    uint16_t get_fragment_count() {
+        return _fragment_count;
+    }
+
+    /**
+     * Get the number of padding bytes in the last fragment of the last encoded image
+     */
+    uint8_t get_padding() {
+        return _padding;
+    }
+
+private:
+    typedef std::function<int(uint8_t *buffer, size_t offset, size_t length)> ReadFunction;
+
+    FragResult encode_stream(size_t size, ReadFunction read, FrameCallback cb) {
+        const size_t frag_size = _opts.FragmentSize;
+        const size_t redundancy = _opts.RedundancyPackets;
+
+        if (frag_size == 0 || size == 0) return FRAG_SIZE_INCORRECT;
+
+        size_t fragments = (size + frag_size - 1) / frag_size;
+        if (fragments + redundancy > 0xffff) {
+            tr_warn("Image needs %lu fragments, does not fit in a session", (unsigned long)fragments);
+            return FRAG_SIZE_INCORRECT;
+        }
+
+        _fragment_count = fragments;
+        _padding = (fragments * frag_size) - size;
+
+        const size_t row_words = FRAG_BITS_TO_WORDS(fragments);
+        const size_t chunk_fragments = FRAG_ENCODER_CHUNK_FRAGMENTS;
+
+        std::vector<frag_word_t> rows;
+        std::vector<uint8_t> chunk;
+        try {
+            _coded.assign(redundancy * frag_size, 0);
+            rows.resize(redundancy * row_words);
+            chunk.resize(chunk_fragments * frag_size);
+        }
+        catch (std::bad_alloc&) {
+            tr_warn("Could not allocate memory");
+            return FRAG_NO_MEMORY;
+        }
+
+        size_t threads = _opts.Threads;
+        if (threads == 0) threads = std::thread::hardware_concurrency();
+        if (threads == 0) threads = 1;
+        if (threads > redundancy) threads = redundancy;
+
+        // parity rows for all redundancy frames, the first redundancy frame is row 1
+        run_parallel(threads, [&](size_t first, size_t last) {
+            for (size_t n = first; n < last; n++) {
+                FragmentationMath::FragmentationGetParityMatrixRow(n + 1, fragments, &rows[n * row_words]);
+            }
+        });
+
+        for (size_t start = 0; start < fragments; start += chunk_fragments) {
+            size_t count = fragments - start;
+            if (count > chunk_fragments) count = chunk_fragments;
+
+            size_t offset = start * frag_size;
+            size_t length = count * frag_size;
+            if (length > size - offset) {
+                // last fragment is padded with zeros
+                memset(&chunk[size - offset], 0, length - (size - offset));
+                length = size - offset;
+            }
+
+            if (read(&chunk[0], offset, length) != 0) {
+                tr_warn("Could not read %lu bytes at offset %lu", (unsigned long)length, (unsigned long)offset);
+                return FRAG_FLASH_READ_ERROR;
+            }
+
+            if (cb) {
+                for (size_t ix = 0; ix < count; ix++) {
+                    cb(start + ix + 1, &chunk[ix * frag_size], frag_size);
+                }
+            }
+
+            // chunk starts are word aligned, so every row can be walked a word at a time
+            const size_t first_word = start / FRAG_WORD_BITS;
+            const size_t last_word = FRAG_BITS_TO_WORDS(start + count);
+
+            run_parallel(threads, [&](size_t first, size_t last) {
+                for (size_t n = first; n < last; n++) {
+                    const frag_word_t *row = &rows[n * row_words];
+                    uint8_t *coded = &_coded[n * frag_size];
+
+                    for (size_t w = first_word; w < last_word; w++) {
+                        frag_word_t word = row[w];
+                        while (word) {
+                            size_t l = (w * FRAG_WORD_BITS) + FragmentationMath::CountTrailingZeros(word);
+                            word &= word - 1;
+
+                            FragmentationMath::XorLineData(coded, &chunk[(l - start) * frag_size], frag_size);
+                        }
+                    }
+                }
+            });
+        }
+
+        if (cb) {
+            for (size_t n = 0; n < redundancy; n++) {
+                cb(fragments + n + 1, &_coded[n * frag_size], frag_size);
+            }
+        }
+
+        return FRAG_OK;
+    }
+
+    /**
+     * Split the redundancy frames in contiguous ranges and process every range on its own thread
+     */
+    void run_parallel(size_t threads, const std::function<void(size_t, size_t)> &fn) {
+        const size_t redundancy = _opts.RedundancyPackets;
+
+        if (threads <= 1) {
+            fn(0, redundancy);
+            return;
+        }
+
+        std::vector<std::thread> workers;
+        size_t per_thread = (redundancy + threads - 1) / threads;
+        for (size_t first = 0; first < redundancy; first += per_thread) {
+            size_t last = first + per_thread;
+            if (last > redundancy) last = redundancy;
+            workers.push_back(std::thread(fn, first, last));
+        }
+        for (size_t ix = 0; ix < workers.size(); ix++) {
+            workers[ix].join();
+        }
+    }
+
+    FragmentationEncoderOpts_t _opts;
+    uint16_t _fragment_count;
+    uint8_t _padding;
+    std::vector<uint8_t> _coded;
+};
+
+#endif // _MBEDFRAG_FRAGMENTATION_ENCODER_H
@@ -0,0 +1,183 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_FRAGMENTATION_FRAME_QUEUE_H
+#define _MBEDFRAG_FRAGMENTATION_FRAME_QUEUE_H
+
+/**
+ * Lock-free ring of fixed-size frame slots, with a single producer (e.g. the radio
+ * callback, also from interrupt context) and a single consumer (the decoder).
+ *
+ * The producer only writes the head, and the consumer only writes the tail. A slot is
+ * filled before the head is moved past it, and read before the tail is moved past it,
+ * so neither side ever waits for the other. One slot is kept free to tell a full ring
+ * from an empty one.
+ */
+
+#include "mbed.h"
+
+#if defined(__MBED__)
+// single core, aligned 32-bit loads and stores are atomic, the barrier orders them against the slot data
+typedef volatile uint32_t frag_queue_index_t;
+
+static inline uint32_t frag_queue_load(const frag_queue_index_t *index) {
+    uint32_t value = *index;
+    __DMB();
+    return value;
+}
+
+static inline void frag_queue_store(frag_queue_index_t *index, uint32_t value) {
+    __DMB();
+    *index = value;
+}
+#else
+#include <atomic>
+
+typedef std::atomic<uint32_t> frag_queue_index_t;
+
+static inline uint32_t frag_queue_load(const frag_queue_index_t *index) {
+    return index->load(std::memory_order_acquire);
+}
+
+static inline void frag_queue_store(frag_queue_index_t *index, uint32_t value) {
+    index->store(value, std::memory_order_release);
+}
+#endif
+
+typedef struct {
+    uint16_t index;     // index of the frame
+    uint16_t size;      // bytes of data in the slot
+} frag_queue_slot_t;
+
+class FragmentationFrameQueue {
+public:
+    /**
+     * @param frame_count   Number of frames that the ring holds
+     * @param frame_size    Largest frame that fits in a slot
+     */
+    FragmentationFrameQueue(size_t frame_count, size_t frame_size)
+        : _slot_count(frame_count + 1), _frame_size(frame_size),
+          _slot_size(sizeof(frag_queue_slot_t) + ((frame_size + sizeof(frag_queue_slot_t) - 1) & ~(sizeof(frag_queue_slot_t) - 1))),
+          _slots(NULL), _dropped(0)
+    {
+        frag_queue_store(&_head, 0);
+        frag_queue_store(&_tail, 0);
+    }
+
+    ~FragmentationFrameQueue() {
+        if (_slots) free(_slots);
+    }
+
+    /**
+     * Allocate the slots
+     *
+     * @returns true if the memory was allocated
+     */
+    bool initialize() {
+        if (_slots) return true;
+
+        _slots = static_cast<uint8_t*>(calloc(_slot_count, _slot_size));
+        return _slots != NULL;
+    }
+
+    /**
+     * Copy a frame into the ring, never blocks. Only call from the producer.
+     *
+     * @param index     The index of the frame
+     * @param buffer    The contents of the frame
+     * @param size      The size of the buffer
+     *
+     * @returns true if the frame was queued, false if the ring was full or the frame too large (the frame is dropped)
+     */
+    bool push(uint16_t index, const uint8_t *buffer, size_t size) {
+        uint32_t head = frag_queue_load(&_head);
+        uint32_t next = head + 1 == _slot_count ? 0 : head + 1;
+
+        if (size > _frame_size || next == frag_queue_load(&_tail)) {
+            _dropped++;
+            return false;
+        }
+
+        frag_queue_slot_t *slot = get_slot(head);
+        slot->index = index;
+        slot->size = size;
+        memcpy(slot + 1, buffer, size);
+
+        frag_queue_store(&_head, next);
+        return true;
+    }
+
+    /**
+     * Look at the oldest frame, which stays in the ring until 'pop' is called. Only call from the consumer.
+     *
+     * @param index     Receives the index of the frame
+     * @param buffer    Receives a pointer to the contents of the frame in the slot
+     * @param size      Receives the size of the frame
+     *
+     * @returns true if there is a frame, false if the ring is empty
+     */
+    bool front(uint16_t *index, uint8_t **buffer, size_t *size) {
+        uint32_t tail = frag_queue_load(&_tail);
+        if (tail == frag_queue_load(&_head)) return false;
+
+        frag_queue_slot_t *slot = get_slot(tail);
+        *index = slot->index;
+        *buffer = reinterpret_cast<uint8_t*>(slot + 1);
+        *size = slot->size;
+        return true;
+    }
+
+    /**
+     * Release the oldest frame, so its slot can be reused. Only call from the consumer.
+     */
+    void pop() {
+        uint32_t tail = frag_queue_load(&_tail);
+        if (tail == frag_queue_load(&_head)) return;
+
+        frag_queue_store(&_tail, tail + 1 == _slot_count ? 0 : tail + 1);
+    }
+
+    /**
+     * Whether there are frames in the ring
+     */
+    bool empty() {
+        return frag_queue_load(&_tail) == frag_queue_load(&_head);
+    }
+
+    /**
+     * Number of frames that were dropped by 'push'. Only updated by the producer.
+     */
+    uint32_t get_dropped() {
+        return _dropped;
+    }
+
+private:
+    frag_queue_slot_t *get_slot(uint32_t ix) {
+        return reinterpret_cast<frag_queue_slot_t*>(_slots + (ix * _slot_size));
+    }
+
+    size_t _slot_count;
+    size_t _frame_size;
+    size_t _slot_size;          // header plus frame, rounded up so every slot header is aligned
+    uint8_t *_slots;
+
+    frag_queue_index_t _head;   // next slot that the producer fills
+    frag_queue_index_t _tail;   // next slot that the consumer reads
+    volatile uint32_t _dropped;
+};
+
+#endif // _MBEDFRAG_FRAGMENTATION_FRAME_QUEUE_H
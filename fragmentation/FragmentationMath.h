@@ -16,11 +16,78 @@ Description: 	Firmware update over the air with LoRa proof of concept
 #include "mbed.h"
 #include "mbed_debug.h"
 #include "BlockDevice.h"
+#include "FragmentationRowStore.h"
+#include "FragmentationStats.h"
+#include "FragmentationCheckpoint.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #include "mbed_trace.h"
+#undef TRACE_GROUP
 #define TRACE_GROUP "FMTH"
 
 #define FRAG_SESSION_ONGOING    0xffff
+#define FRAG_SESSION_DECODING   0xfffe
+
+// Number of stored frames that the deferred decoder eliminates per pass over the binary
+#ifndef FRAG_DEFERRED_BATCH_FRAMES
+#define FRAG_DEFERRED_BATCH_FRAMES  8
+#endif
+
+// The GF(2) vectors and the M2 matrix are packed in machine words, LSB first
+#if !defined(FRAG_WORD_BITS)
+#if defined(__LP64__) || defined(_WIN64)
+#define FRAG_WORD_BITS          64
+#else
+#define FRAG_WORD_BITS          32
+#endif
+#endif
+
+#if FRAG_WORD_BITS == 64
+typedef uint64_t frag_word_t;
+#else
+typedef uint32_t frag_word_t;
+#endif
+
+#define FRAG_BITS_TO_WORDS(bits) (((bits) + FRAG_WORD_BITS - 1) / FRAG_WORD_BITS)
+#define FRAG_ALIGN_SIZE(size)    (((size) + sizeof(frag_word_t) - 1) & ~(sizeof(frag_word_t) - 1))
+
+// Memory that FragmentationMath::initialize needs without deferred decoding, checkpoints, shared scratch space
+// or a RAM budget, as a constant expression. FragmentationMath::get_memory_size covers every configuration.
+#define FRAG_MATH_MEMORY_SIZE(frame_count, frame_size, redundancy_max) (                                          \
+      (FRAG_BITS_TO_WORDS(redundancy_max) * (redundancy_max) * sizeof(frag_word_t))     /* matrixM2B */             \
+    + FRAG_ALIGN_SIZE((frame_count) * sizeof(uint16_t))                                /* missingFrameIndex */     \
+    + FRAG_ALIGN_SIZE((redundancy_max) * sizeof(uint16_t))                             /* reverse index */         \
+    + (FRAG_BITS_TO_WORDS(frame_count) * sizeof(frag_word_t))                          /* matrixRow */             \
+    + (2 * FRAG_ALIGN_SIZE(frame_size))                                                /* data temp buffers */     \
+    + (2 * FRAG_BITS_TO_WORDS(redundancy_max) * sizeof(frag_word_t)))                  /* dataTempVector and s */
+
+// Additional memory for deferred decoding and for checkpoints
+#define FRAG_MATH_DEFERRED_MEMORY_SIZE(frame_count, frame_size, redundancy_max, batch_frames) (                    \
+      FRAG_ALIGN_SIZE((redundancy_max) * sizeof(uint16_t))                             /* stored frames */         \
+    + FRAG_ALIGN_SIZE((batch_frames) * (frame_size))                                   /* batch data */            \
+    + ((batch_frames) * FRAG_BITS_TO_WORDS(frame_count) * sizeof(frag_word_t)))        /* batch rows */
+#define FRAG_MATH_CHECKPOINT_MEMORY_SIZE(redundancy_max)   (FRAG_BITS_TO_WORDS(redundancy_max) * sizeof(frag_word_t))
+
+// word view on fragment data, which is allowed to alias the byte buffers
+#if defined(__GNUC__) || defined(__clang__)
+typedef frag_word_t __attribute__((__may_alias__)) frag_alias_word_t;
+#else
+typedef frag_word_t frag_alias_word_t;
+#endif
+
+// Decoder counters in a checkpoint
+typedef struct
+{
+    uint32_t NumberOfLoosingFrame;
+    uint32_t LastReceiveFrameCnt;
+    uint32_t M2l;
+    uint32_t DeferredCount;
+} FragmentationMathCheckpoint_t;
 
 typedef struct
 {
@@ -41,230 +108,1034 @@ class FragmentationMath
      * @param frame_count    Number of expected fragments (without redundancy packets)
      * @param frame_size     Size of a fragment (without LoRaWAN header)
      * @param redundancy_max Maximum number of redundancy packets
+     * @param flash_offset   Place in flash where the binary is placed
      */
     FragmentationMath(FragmentationBlockDeviceWrapper *flash, uint16_t frame_count, uint8_t frame_size, uint16_t redundancy_max, size_t flash_offset)
-        : _flash(flash), _frame_count(frame_count), _frame_size(frame_size), _redundancy_max(redundancy_max), _flash_offset(flash_offset)
+        : _flash(flash), _frame_count(frame_count), _frame_size(frame_size), _redundancy_max(redundancy_max), _flash_offset(flash_offset),
+          _vector_words(0), matrixM2B(NULL), missingFrameIndex(NULL), missingFrameReverseIndex(NULL),
+          matrixRow(NULL), matrixDataTemp(NULL), dataTempVector(NULL), s(NULL), xorRowDataTemp(NULL),
+          numberOfLoosingFrame(0), lastReceiveFrameCnt(0), m2l(0),
+          _resumable(false), _decoding(false), _bs_row(-1), _bs_column(0),
+          _deferred(false), _scratch_offset(0), _batch_frames(FRAG_DEFERRED_BATCH_FRAMES), _deferred_count(0), _solve_next(0),
+          _deferred_frames(NULL), _batch_data(NULL), _batch_rows(NULL), _batched(false),
+          _journal(NULL), _ckpt_rows(NULL), _ckpt_missing_first(0xffff), _ckpt_missing_end(0), _ckpt_lost(0), _ckpt_deferred(0),
+          _scratch(NULL), _arena(NULL), _arena_size(0), _memory(NULL), _memory_size(0), _memory_owned(false),
+          _rows(flash, flash_offset, frame_size)
+    {
+#if FRAG_ENABLE_STATS
+        memset(&_stats, 0, sizeof(_stats));
+        _clock = NULL;
+#endif
+    }
+
+    ~FragmentationMath()
+    {
+        FreeBuffers();
+    }
+
+    /**
+     * Initialize the FragmentationMath library. This function allocates the required buffers,
+     * all at once, from the arena that was passed to set_arena() or else from the heap.
+     * It can be called again to start over, the memory is then reused when it's large enough.
+     *
+     * @param ram_budget Number of bytes that may be used to keep recovered rows in RAM instead of in flash
+     *
+     * @returns true if the memory was allocated, false if the allocation failed or the arena is too small
+     */
+    bool initialize(size_t ram_budget = 0)
+    {
+        _vector_words = FRAG_BITS_TO_WORDS(_redundancy_max);
+
+        size_t size = Layout(NULL, ram_budget);
+
+        if (_arena)
+        {
+            FreeBuffers();
+
+            // carve from the first word-aligned address in the arena
+            uint8_t *memory = (uint8_t *)FRAG_ALIGN_SIZE((uintptr_t)_arena);
+            if (memory + size > _arena + _arena_size)
+            {
+                tr_warn("Arena of %lu bytes is too small, %lu bytes required",
+                    (unsigned long)_arena_size, (unsigned long)(size + (memory - _arena)));
+                return false;
+            }
+            _memory = memory;
+            _memory_size = size;
+        }
+        else if (!_memory_owned || size > _memory_size)
+        {
+            FreeBuffers();
+
+            _memory = (uint8_t *)calloc(size, 1);
+            if (!_memory)
+            {
+                tr_warn("Could not allocate memory");
+                return false;
+            }
+            _memory_size = size;
+            _memory_owned = true;
+        }
+
+        memset(_memory, 0, size);
+        Layout(_memory, ram_budget);
+
+        for (size_t ix = 0; ix < _frame_count; ix++)
+        {
+            missingFrameIndex[ix] = 1;
+        }
+
+        numberOfLoosingFrame = 0;
+        lastReceiveFrameCnt = 0;
+        m2l = 0;
+        _decoding = false;
+        _bs_row = -1;
+        _deferred_count = 0;
+        _solve_next = 0;
+        _ckpt_missing_first = 0xffff;
+        _ckpt_missing_end = 0;
+        _ckpt_lost = 0;
+        _ckpt_deferred = 0;
+#if FRAG_ENABLE_STATS
+        memset(&_stats, 0, sizeof(_stats));
+#endif
+
+        return true;
+    }
+
+    /**
+     * Carve the buffers out of caller-owned memory instead of allocating them on the heap. Call before initialize().
+     *
+     * @param arena         Memory for the buffers, or NULL to allocate them on the heap again
+     * @param arena_size    Size of the arena, at least get_memory_size() bytes, plus sizeof(frag_word_t) - 1
+     *                      if the arena is not word-aligned
+     */
+    void set_arena(uint8_t *arena, size_t arena_size)
+    {
+        FreeBuffers();
+        _arena = arena;
+        _arena_size = arena_size;
+    }
+
+    /**
+     * Number of bytes that initialize() needs, with the current settings (deferred decoding, checkpoints, shared scratch)
+     *
+     * @param ram_budget Number of bytes that may be used to keep recovered rows in RAM
+     */
+    size_t get_memory_size(size_t ram_budget = 0)
+    {
+        _vector_words = FRAG_BITS_TO_WORDS(_redundancy_max);
+        return Layout(NULL, ram_budget);
+    }
+
+    /**
+     * Start over with other session parameters, the memory is reused by the next initialize() call
+     * when it's large enough.
+     *
+     * @param frame_count    Number of expected fragments (without redundancy packets)
+     * @param frame_size     Size of a fragment (without LoRaWAN header)
+     * @param redundancy_max Maximum number of redundancy packets
+     * @param flash_offset   Place in flash where the binary is placed
+     */
+    void set_parameters(uint16_t frame_count, uint8_t frame_size, uint16_t redundancy_max, size_t flash_offset)
+    {
+        _frame_count = frame_count;
+        _frame_size = frame_size;
+        _redundancy_max = redundancy_max;
+        _flash_offset = flash_offset;
+        _rows.set_layout(flash_offset, frame_size);
+    }
+
+    /**
+     * Let the library know that a frame was found.
+     * @param frameCounter
+     */
+    void set_frame_found(uint16_t frameCounter)
+    {
+        missingFrameIndex[frameCounter - 1] = 0;
+        MarkMissingChanged(frameCounter - 1, frameCounter);
+
+        FindMissingReceiveFrame(frameCounter);
+    }
+
+    /**
+     * Process a redundancy frame
+     *
+     * @param frameCounter      The frameCounter for this frame
+     * @param rowData           Binary data of the frame (without LoRaWAN header)
+     * @param sFotaParameter    Current state of the fragmentation session
+     *
+     * @returns FRAG_SESSION_ONGOING if the packets are not completed yet,
+                FRAG_SESSION_DECODING if the matrix is complete and back_substitute() needs to be called (resumable mode only),
+                any other value between 0..FRAG_SESSION_DECODING if the packet was deconstructed
+     */
+    int process_redundant_frame(uint16_t frameCounter, uint8_t *rowData, FragmentationMathSessionParams_t sFotaParameter)
+    {
+#if FRAG_ENABLE_STATS
+        // the back-substitution (and the deferred solve) can run from here, those are timed on their own
+        uint64_t start = StatsClock();
+        uint64_t nested = _stats.SolveTime + _stats.BackSubstitutionTime;
+
+        int r = ProcessRedundantFrame(frameCounter, rowData, sFotaParameter);
+
+        _stats.ForwardTime += (StatsClock() - start) - (_stats.SolveTime + _stats.BackSubstitutionTime - nested);
+        return r;
+#else
+        return ProcessRedundantFrame(frameCounter, rowData, sFotaParameter);
+#endif
+    }
+
+    /**
+     * Process redundancy frames that arrived together. With set_batch(), up to batch_frames frames
+     * are eliminated at once, so every received fragment that they use is read from flash once.
+     *
+     * @param frameCounters     The frameCounters of the frames, in ascending order
+     * @param rowData           Binary data of the frames (without LoRaWAN header)
+     * @param count             Number of frames
+     * @param sFotaParameter    Current state of the fragmentation session
+     *
+     * @returns the same as process_redundant_frame, for the frame that completed the matrix or else for the last frame
+     */
+    int process_redundant_frames(const uint16_t *frameCounters, uint8_t *const *rowData, int count, FragmentationMathSessionParams_t sFotaParameter)
+    {
+        int r = FRAG_SESSION_ONGOING;
+
+        for (int k = 0; k < count && r == FRAG_SESSION_ONGOING; )
+        {
+            int batch = count - k;
+
+            // in deferred mode frames only cost a rank check when they come in
+            if (_deferred || !_batched || batch == 1)
+            {
+                r = process_redundant_frame(frameCounters[k], rowData[k], sFotaParameter);
+                k++;
+                continue;
+            }
+
+            if (batch > _batch_frames)
+            {
+                batch = _batch_frames;
+            }
+
+#if FRAG_ENABLE_STATS
+            uint64_t start = StatsClock();
+            uint64_t nested = _stats.SolveTime + _stats.BackSubstitutionTime;
+
+            r = ProcessRedundantBatch(frameCounters + k, rowData + k, batch);
+
+            _stats.ForwardTime += (StatsClock() - start) - (_stats.SolveTime + _stats.BackSubstitutionTime - nested);
+#else
+            r = ProcessRedundantBatch(frameCounters + k, rowData + k, batch);
+#endif
+            k += batch;
+        }
+
+        return r;
+    }
+
+    /**
+     * Allocate room for a batch of redundancy frames, so process_redundant_frames can eliminate them together.
+     * Takes batch_frames * frame_size bytes, plus a parity row per frame. Call before initialize().
+     *
+     * @param batch_frames      Number of frames that are eliminated together, 0 to process every frame on its own
+     */
+    void set_batch(uint16_t batch_frames)
+    {
+        _batched = batch_frames > 0;
+        if (_batched)
+        {
+            _batch_frames = batch_frames;
+        }
+    }
+
+    /**
+     * Room for a batch of frames, that the caller can use while no frames are being processed
+     *
+     * @param size  Receives the size of the buffer, 0 if there is none
+     */
+    uint8_t *get_batch_buffer(size_t *size)
+    {
+        *size = _batch_data ? _batch_frames * _frame_size : 0;
+        return _batch_data;
+    }
+
+    /**
+     * Get the number of lost frames
+     */
+    int get_lost_frame_count()
+    {
+        return numberOfLoosingFrame;
+    }
+
+    /**
+     * Don't run the back-substitution from process_redundant_frame, but let the caller
+     * run it in steps through back_substitute(). Call before the last redundancy frame comes in.
+     */
+    void set_resumable(bool resumable)
+    {
+        _resumable = resumable;
+    }
+
+    /**
+     * Don't eliminate redundancy frames when they come in, but store them in a scratch area in flash,
+     * and solve the system in one pass when enough frames were received. Call before initialize().
+     *
+     * Frames are only checked against the other frames in RAM when they come in, frames that don't add
+     * any information are dropped. The solve reads the binary once per batch of stored frames.
+     *
+     * @param scratch_offset    Place in flash for the stored frames, needs room for redundancy_max * frame_size bytes
+     * @param batch_frames      Number of stored frames that are eliminated in one pass over the binary,
+     *                          takes batch_frames * frame_size bytes of RAM during the session
+     */
+    void set_deferred(size_t scratch_offset, uint16_t batch_frames = FRAG_DEFERRED_BATCH_FRAMES)
+    {
+        _deferred = true;
+        _scratch_offset = scratch_offset;
+        _batch_frames = batch_frames ? batch_frames : 1;
+    }
+
+    /**
+     * Keep the recovered rows that don't fit in the RAM budget in a spill area in flash until they are final,
+     * so every place in the binary is programmed once. Call before initialize().
+     *
+     * @param spill_offset  Place in flash for the rows, needs room for redundancy_max * frame_size bytes
+     */
+    void set_spill(size_t spill_offset)
+    {
+        _rows.set_spill(spill_offset);
+    }
+
+    /**
+     * Size of the scratch space that is only used during a single call, in bytes
+     *
+     * @param frame_count    Number of expected fragments (without redundancy packets)
+     * @param frame_size     Size of a fragment (without LoRaWAN header)
+     * @param redundancy_max Maximum number of redundancy packets
+     */
+    static size_t get_scratch_size(uint16_t frame_count, uint8_t frame_size, uint16_t redundancy_max)
+    {
+        return (FRAG_BITS_TO_WORDS(frame_count) + FRAG_BITS_TO_WORDS(redundancy_max)) * sizeof(frag_word_t) + frame_size;
+    }
+
+    /**
+     * Use caller-owned scratch space instead of allocating it. Sessions can share the same scratch space,
+     * as long as they are not called from different threads at the same time. Call before initialize().
+     *
+     * @param scratch   Word-aligned buffer of at least get_scratch_size() bytes, or NULL to allocate it again
+     */
+    void set_scratch(uint8_t *scratch)
+    {
+        FreeBuffers();
+        _scratch = scratch;
+    }
+
+    /**
+     * Whether the matrix is complete, but the back-substitution did not finish yet
+     */
+    bool is_decoding()
+    {
+        return _decoding;
+    }
+
+    /**
+     * Run (part of) the back-substitution. Every row that is read to be XOR'ed in,
+     * and every row that is stored, counts as one row operation.
+     * In deferred mode, a call first eliminates one batch of stored frames instead, until all are done.
+     *
+     * @param budget    Maximum number of row operations, or -1 to run until done
+     *
+     * @returns FRAG_SESSION_DECODING if there are rows left,
+     *          FRAG_SESSION_ONGOING if there was nothing to decode,
+     *          the number of lost frames if the packet was deconstructed
+     */
+    int back_substitute(int budget)
+    {
+#if FRAG_ENABLE_STATS
+        uint64_t start = StatsClock();
+        uint64_t solve = _stats.SolveTime;
+
+        int r = BackSubstitute(budget);
+
+        _stats.BackSubstitutionTime += (StatsClock() - start) - (_stats.SolveTime - solve);
+        return r;
+#else
+        return BackSubstitute(budget);
+#endif
+    }
+
+    /**
+     * Set the clock that is used to time the decoding phases
+     *
+     * @param clock Function that returns the current time, in any unit
+     */
+    void set_clock(frag_stats_clock_t clock)
+    {
+#if FRAG_ENABLE_STATS
+        _clock = clock;
+#else
+        (void)clock;
+#endif
+    }
+
+    /**
+     * Get the counters of this session, only the fields that belong to FragmentationMath are set.
+     * All zeros unless FRAG_ENABLE_STATS is set.
+     */
+    FragmentationStats_t get_statistics()
+    {
+#if FRAG_ENABLE_STATS
+        return _stats;
+#else
+        FragmentationStats_t stats;
+        memset(&stats, 0, sizeof(stats));
+        return stats;
+#endif
+    }
+
+    /**
+     * Keep track of the state that changed since the last checkpoint. Call before initialize().
+     *
+     * @param journal   Journal that the checkpoints are written to, the start of decoding is marked in it
+     */
+    void set_checkpoint(FragmentationCheckpoint *journal)
+    {
+        _journal = journal;
+    }
+
+    /**
+     * Write the decoder state to the current record of the journal. Only the state that changed
+     * since the last call to checkpoint_committed() is written, unless 'full' is set.
+     * Don't call this while decoding.
+     *
+     * @param journal   Journal with a started record
+     * @param full      Write all state
+     *
+     * @returns 0 if succeeded, or an error from the journal
+     */
+    int checkpoint(FragmentationCheckpoint *journal, bool full)
     {
+        FragmentationMathCheckpoint_t state;
+        uint16_t range[2];
+        uint16_t rows = 0;
+        uint16_t row;
+        uint8_t has_data;
+        int r;
+
+        state.NumberOfLoosingFrame = numberOfLoosingFrame;
+        state.LastReceiveFrameCnt = lastReceiveFrameCnt;
+        state.M2l = m2l;
+        state.DeferredCount = _deferred_count;
+        if ((r = journal->write(&state, sizeof(state))) != 0) return r;
+
+        // missing frame index, as one range of entries
+        range[0] = 0;
+        range[1] = 0;
+        if (full)
+        {
+            range[1] = _frame_count;
+        }
+        else if (_ckpt_missing_end > _ckpt_missing_first)
+        {
+            range[0] = _ckpt_missing_first;
+            range[1] = _ckpt_missing_end;
+        }
+        if ((r = journal->write(range, sizeof(range))) != 0) return r;
+        if ((r = journal->write(missingFrameIndex + range[0], (range[1] - range[0]) * sizeof(uint16_t))) != 0) return r;
+
+        // the reverse index only grows
+        range[0] = full ? 0 : _ckpt_lost;
+        range[1] = numberOfLoosingFrame < _redundancy_max ? numberOfLoosingFrame : _redundancy_max;
+        if (range[1] < range[0]) range[1] = range[0];
+        if ((r = journal->write(range, sizeof(range))) != 0) return r;
+        if ((r = journal->write(missingFrameReverseIndex + range[0], (range[1] - range[0]) * sizeof(uint16_t))) != 0) return r;
+
+        // so do the stored frames in deferred mode
+        range[0] = full ? 0 : _ckpt_deferred;
+        range[1] = _deferred_count;
+        if ((r = journal->write(range, sizeof(range))) != 0) return r;
+        if ((r = journal->write(_deferred_frames + range[0], (range[1] - range[0]) * sizeof(uint16_t))) != 0) return r;
+
+        // rows that were added to M2, with the data of the ones that are kept in RAM or in the spill area
+        for (row = 0; row < _redundancy_max; row++)
+        {
+            if (GetBit(s, row) && (full || GetBit(_ckpt_rows, row)))
+            {
+                rows++;
+            }
+        }
+        if ((r = journal->write(&rows, sizeof(rows))) != 0) return r;
+
+        for (row = 0; row < _redundancy_max; row++)
+        {
+            if (!GetBit(s, row) || !(full || GetBit(_ckpt_rows, row)))
+            {
+                continue;
+            }
+
+            has_data = !_deferred && (row < _rows.get_ram_rows() || _rows.has_spill());
+            if ((r = journal->write(&row, sizeof(row))) != 0) return r;
+            if ((r = journal->write(&has_data, sizeof(has_data))) != 0) return r;
+            if ((r = journal->write(MatrixM2Line(row), _vector_words * sizeof(frag_word_t))) != 0) return r;
+
+            if (has_data)
+            {
+                GetMissingRow(row, FindMissingFrameIndex(row), xorRowDataTemp);
+                if ((r = journal->write(xorRowDataTemp, _frame_size)) != 0) return r;
+            }
+        }
+
+        return 0;
+    }
+
+    /**
+     * The last checkpoint was committed, start tracking changes from here
+     */
+    void checkpoint_committed()
+    {
+        _ckpt_missing_first = 0xffff;
+        _ckpt_missing_end = 0;
+        _ckpt_lost = numberOfLoosingFrame < _redundancy_max ? numberOfLoosingFrame : _redundancy_max;
+        _ckpt_deferred = _deferred_count;
+        if (_ckpt_rows)
+        {
+            memset(_ckpt_rows, 0, _vector_words * sizeof(frag_word_t));
+        }
+    }
+
+    /**
+     * Apply the decoder state in the current record of the journal, in the order in which the checkpoints were written.
+     * Call after initialize().
+     *
+     * @returns 0 if succeeded, FRAG_CHECKPOINT_END if the record is not valid for this session, or a block device error
+     */
+    int restore(FragmentationCheckpoint *journal)
+    {
+        FragmentationMathCheckpoint_t state;
+        uint16_t range[2];
+        uint16_t rows;
+        uint16_t row;
+        uint8_t has_data;
+        int r;
+
+        if ((r = journal->read(&state, sizeof(state))) != 0) return r;
+        if (state.NumberOfLoosingFrame > _frame_count || state.M2l > _redundancy_max || state.DeferredCount > _redundancy_max)
+        {
+            return FRAG_CHECKPOINT_END;
+        }
+        numberOfLoosingFrame = state.NumberOfLoosingFrame;
+        lastReceiveFrameCnt = state.LastReceiveFrameCnt;
+        m2l = state.M2l;
+        _deferred_count = state.DeferredCount;
+
+        if ((r = journal->read(range, sizeof(range))) != 0) return r;
+        if (range[0] > range[1] || range[1] > _frame_count) return FRAG_CHECKPOINT_END;
+        if ((r = journal->read(missingFrameIndex + range[0], (range[1] - range[0]) * sizeof(uint16_t))) != 0) return r;
+
+        if ((r = journal->read(range, sizeof(range))) != 0) return r;
+        if (range[0] > range[1] || range[1] > _redundancy_max) return FRAG_CHECKPOINT_END;
+        if ((r = journal->read(missingFrameReverseIndex + range[0], (range[1] - range[0]) * sizeof(uint16_t))) != 0) return r;
+
+        if ((r = journal->read(range, sizeof(range))) != 0) return r;
+        if (range[0] > range[1] || range[1] > _redundancy_max || (range[1] > range[0] && !_deferred)) return FRAG_CHECKPOINT_END;
+        if (range[1] > range[0])
+        {
+            if ((r = journal->read(_deferred_frames + range[0], (range[1] - range[0]) * sizeof(uint16_t))) != 0) return r;
+        }
+
+        if ((r = journal->read(&rows, sizeof(rows))) != 0) return r;
+        while (rows--)
+        {
+            if ((r = journal->read(&row, sizeof(row))) != 0) return r;
+            if ((r = journal->read(&has_data, sizeof(has_data))) != 0) return r;
+            if (row >= _redundancy_max) return FRAG_CHECKPOINT_END;
+            if ((r = journal->read(MatrixM2Line(row), _vector_words * sizeof(frag_word_t))) != 0) return r;
+            SetBit(s, row);
+
+            // rows are written to RAM or to flash, depending on the RAM budget of this session
+            if (has_data)
+            {
+                if ((r = journal->read(xorRowDataTemp, _frame_size)) != 0) return r;
+                StoreMissingRow(xorRowDataTemp, row, FindMissingFrameIndex(row));
+            }
+            else if (!_deferred && row < _rows.get_ram_rows())
+            {
+                r = _rows.read_flash(row, FindMissingFrameIndex(row), xorRowDataTemp);
+                if (r != 0) return r;
+                StoreMissingRow(xorRowDataTemp, row, FindMissingFrameIndex(row));
+            }
+        }
+
+        checkpoint_committed();
+        return 0;
+    }
+
+    /**
+     * Calculate which uncoded fragments are combined in a redundancy frame
+     *
+     * @param N         Index of the redundancy frame (1-based, frameCounter - number of fragments)
+     * @param M         Number of uncoded fragments
+     * @param matrixRow Scratch space of FRAG_BITS_TO_WORDS(M) words, holds the parity row afterwards
+     * @param indices   Receives the 0-based fragment indices, sorted and without duplicates.
+     *                  Needs room for M / 2 entries.
+     *
+     * @returns the number of indices written
+     */
+    static int get_parity_matrix_row(int N, int M, frag_word_t *matrixRow, uint16_t *indices)
+    {
+        int count = 0;
+
+        FragmentationGetParityMatrixRow(N, M, matrixRow);
+
+        for (int w = 0; w < (int)FRAG_BITS_TO_WORDS(M); w++)
+        {
+            frag_word_t word = matrixRow[w];
+            while (word)
+            {
+                indices[count++] = (w * FRAG_WORD_BITS) + CountTrailingZeros(word);
+                word &= word - 1;
+            }
+        }
+
+        return count;
+    }
+
+  private:
+    friend class FragmentationEncoder;
+
+    int ProcessRedundantFrame(uint16_t frameCounter, uint8_t *rowData, FragmentationMathSessionParams_t sFotaParameter)
+    {
+        int l;
+        int w;
+        frag_word_t word;
+
+        if (_decoding)
+        { // matrixDataTemp holds the row that is being back-substituted
+            return FRAG_SESSION_DECODING;
+        }
+
+        FRAG_STATS_ADD(_stats, RedundancyFrames, 1);
+
+        memset(matrixDataTemp, 0, _frame_size);
+        memset(dataTempVector, 0, _vector_words * sizeof(frag_word_t));
+
+        FindMissingReceiveFrame(frameCounter);
+
+        if (numberOfLoosingFrame > _redundancy_max)
+        {
+            tr_warn("Lost %d frames, more than the %d redundancy frames we can hold", numberOfLoosingFrame, _redundancy_max);
+            return FRAG_SESSION_ONGOING;
+        }
+
+        FragmentationGetParityMatrixRow(frameCounter - sFotaParameter.NbOfFrag, sFotaParameter.NbOfFrag, matrixRow); //frameCounter-sFotaParameter.NbOfFrag
+        FRAG_STATS_ADD(_stats, ParityRowsGenerated, 1);
+
+        if (_deferred)
+        {
+            return ProcessDeferredFrame(frameCounter, rowData);
+        }
+
+        // we should not mess with rowData
+        memcpy(xorRowDataTemp, rowData, sFotaParameter.DataSize);
+
+        // only visit the bits that are set in the parity row
+        for (w = 0; w < (int)FRAG_BITS_TO_WORDS(sFotaParameter.NbOfFrag); w++)
+        {
+            word = matrixRow[w];
+            while (word)
+            {
+                l = (w * FRAG_WORD_BITS) + CountTrailingZeros(word);
+                word &= word - 1;
+
+                if (missingFrameIndex[l] == 0)
+                { // xor with already receive frame
+                    GetRowInFlash(l, matrixDataTemp);
+                    XorLineData(xorRowDataTemp, matrixDataTemp, sFotaParameter.DataSize);
+                    FRAG_STATS_ADD(_stats, BytesXored, sFotaParameter.DataSize);
+                }
+                else
+                { // fill the "little" boolean matrix m2
+                    SetBit(dataTempVector, missingFrameIndex[l] - 1);
+                }
+            }
+        }
+        if (!VectorIsNull(dataTempVector, numberOfLoosingFrame))
+        { //manage a new line in MatrixM2
+            if (AddMatrixM2Row(true))
+            {
+                FRAG_STATS_ADD(_stats, RowsAdded, 1);
+            }
+
+            if (m2l == numberOfLoosingFrame)
+            { // then last step diagonalized
+                return StartBackSubstitution();
+            }
+        }
+
+        return FRAG_SESSION_ONGOING;
+    }
+
+    int BackSubstitute(int budget)
+    {
+        int i;
+        int j;
+        int li;
+        int lj;
+        frag_word_t *lineI;
+
+        if (!_decoding)
+        {
+            return FRAG_SESSION_ONGOING;
+        }
+
+        // deferred mode, first eliminate the stored frames, one batch per step
+        while (_solve_next < _deferred_count)
+        {
+            SolveDeferredBatch();
+            if (budget >= 0)
+            {
+                return FRAG_SESSION_DECODING;
+            }
+        }
+
+        // the last row has nothing to substitute, it's final once all rows were added
+        if (_bs_row == numberOfLoosingFrame - 2 && _bs_column == numberOfLoosingFrame)
+        {
+            FinishMissingRow(numberOfLoosingFrame - 1, FindMissingFrameIndex(numberOfLoosingFrame - 1));
+        }
+
+        // _bs_row is the row that is being reduced, _bs_column the next column to check in that row,
+        // or numberOfLoosingFrame if the row was not loaded in matrixDataTemp yet
+        while (_bs_row >= 0)
+        {
+            i = _bs_row;
+            li = FindMissingFrameIndex(i);
+            lineI = MatrixM2Line(i);
+
+            if (_bs_column == numberOfLoosingFrame)
+            {
+                GetMissingRow(i, li, matrixDataTemp);
+                _bs_column = numberOfLoosingFrame - 1;
+            }
+
+            for (; _bs_column > i; _bs_column--)
+            {
+                j = _bs_column;
+                if (GetBit(lineI, j))
+                {
+                    if (budget == 0)
+                    {
+                        return FRAG_SESSION_DECODING;
+                    }
+                    budget--;
+
+                    XorLineBool(lineI, MatrixM2Line(j), numberOfLoosingFrame);
+
+                    lj = FindMissingFrameIndex(j);
+
+                    GetMissingRow(j, lj, xorRowDataTemp);
+                    XorLineData(matrixDataTemp, xorRowDataTemp, _frame_size);
+                    FRAG_STATS_ADD(_stats, BytesXored, _frame_size);
+                }
+            }
+
+            if (budget == 0)
+            {
+                return FRAG_SESSION_DECODING;
+            }
+            budget--;
+
+            StoreMissingRow(matrixDataTemp, i, li, true);
+            _bs_row--;
+            _bs_column = numberOfLoosingFrame;
+        }
+
+        // all rows are final now, write the ones that were kept in RAM to flash
+        FlushMissingRows();
+        _decoding = false;
+        return (numberOfLoosingFrame);
+    }
+
+#if FRAG_ENABLE_STATS
+    uint64_t StatsClock()
+    {
+        return _clock ? _clock() : 0;
+    }
+#endif
+
+    /*!
+    * \brief	Reduces dataTempVector with the rows in the M2 matrix, and adds it to the matrix
+    *
+    * \param	[IN] withData : also reduce the frame data in xorRowDataTemp, and store it as row
+    * \param	[OUT] true if a row was added, false if the frame did not add information
+    */
+    bool AddMatrixM2Row(bool withData)
+    {
+        int li;
+        int firstOneInRow = FindFirstOne(dataTempVector, numberOfLoosingFrame);
+
+        while (GetBit(s, firstOneInRow))
+        { // row already diagonalized exist&(sFotaParameter.MatrixM2[firstOneInRow][0])
+            XorLineBool(dataTempVector, MatrixM2Line(firstOneInRow), numberOfLoosingFrame);
+            if (withData)
+            {
+                li = FindMissingFrameIndex(firstOneInRow); // have to store it in the mi th position of the missing frame
+                GetMissingRow(firstOneInRow, li, matrixDataTemp);
+                XorLineData(xorRowDataTemp, matrixDataTemp, _frame_size);
+                FRAG_STATS_ADD(_stats, BytesXored, _frame_size);
+            }
+            if (VectorIsNull(dataTempVector, numberOfLoosingFrame))
+            {
+                return false;
+            }
+            firstOneInRow = FindFirstOne(dataTempVector, numberOfLoosingFrame);
+        }
+
+        memcpy(MatrixM2Line(firstOneInRow), dataTempVector, FRAG_BITS_TO_WORDS(numberOfLoosingFrame) * sizeof(frag_word_t));
+        if (withData)
+        {
+            li = FindMissingFrameIndex(firstOneInRow);
+            StoreMissingRow(xorRowDataTemp, firstOneInRow, li);
+        }
+        SetBit(s, firstOneInRow);
+        m2l++;
+        if (_ckpt_rows)
+        {
+            SetBit(_ckpt_rows, firstOneInRow);
+        }
+        return true;
+    }
+
+    int StartBackSubstitution()
+    {
+        // the rows in flash are going to change, a checkpoint from before this point can't be resumed anymore
+        if (_journal)
+        {
+            if (_journal->begin(FRAG_CHECKPOINT_DECODING) != 0 || _journal->commit() != 0)
+            {
+                tr_warn("Could not mark the start of decoding in the checkpoint");
+            }
+        }
+
+        _bs_row = numberOfLoosingFrame - 2;
+        _bs_column = numberOfLoosingFrame;
+        _decoding = true;
+
+        if (_resumable)
+        {
+            return FRAG_SESSION_DECODING;
+        }
+        return back_substitute(-1);
+    }
+
+    /*!
+    * \brief	Sets the bits of the missing frames in a parity row in dataTempVector
+    */
+    void SetMissingBits(const frag_word_t *row)
+    {
+        int l;
+        frag_word_t word;
+
+        for (int w = 0; w < (int)FRAG_BITS_TO_WORDS(_frame_count); w++)
+        {
+            word = row[w];
+            while (word)
+            {
+                l = (w * FRAG_WORD_BITS) + CountTrailingZeros(word);
+                word &= word - 1;
+
+                if (missingFrameIndex[l] != 0)
+                {
+                    SetBit(dataTempVector, missingFrameIndex[l] - 1);
+                }
+            }
+        }
     }
 
-    ~FragmentationMath()
+    /*!
+    * \brief	Deferred mode: checks the rank of a redundancy frame, and stores it if it adds information.
+    *          The parity row is in matrixRow.
+    */
+    int ProcessDeferredFrame(uint16_t frameCounter, uint8_t *rowData)
     {
-        if (matrixM2B)
-        {
-            free(matrixM2B);
-        }
-        if (missingFrameIndex)
-        {
-            free(missingFrameIndex);
-        }
+        SetMissingBits(matrixRow);
 
-        if (matrixRow)
-        {
-            free(matrixRow);
-        }
-        if (matrixDataTemp)
-        {
-            free(matrixDataTemp);
-        }
-        if (dataTempVector)
-        {
-            free(dataTempVector);
-        }
-        if (dataTempVector2)
+        // only track the rank for now, without touching the data
+        if (VectorIsNull(dataTempVector, numberOfLoosingFrame) || !AddMatrixM2Row(false))
         {
-            free(dataTempVector2);
+            return FRAG_SESSION_ONGOING;
         }
-        if (s)
-        {
-            free(s);
+
+        int r = _flash->program(rowData, _scratch_offset + (_deferred_count * _frame_size), _frame_size);
+        if (r != 0) {
+            tr_warn("Storing frame %d in the scratch area failed (%d)", frameCounter, r);
         }
-        if (xorRowDataTemp)
+        _deferred_frames[_deferred_count++] = frameCounter;
+        FRAG_STATS_ADD(_stats, RowsAdded, 1);
+
+        if (m2l < numberOfLoosingFrame)
         {
-            free(xorRowDataTemp);
+            return FRAG_SESSION_ONGOING;
         }
+
+        // full rank, build the matrix again from the stored frames, now with their data
+        memset(matrixM2B, 0, _vector_words * _redundancy_max * sizeof(frag_word_t));
+        memset(s, 0, _vector_words * sizeof(frag_word_t));
+        m2l = 0;
+        _solve_next = 0;
+
+        return StartBackSubstitution();
     }
 
-    /**
-     * Initialize the FragmentationMath library. This function allocates the required buffers.
-     *
-     * @returns true if the memory was allocated, false if one or more allocations failed
-     */
-    bool initialize()
+    /*!
+    * \brief	Deferred mode: XORs the received fragments into the next batch of stored frames
+    *          in one sequential pass over the binary, and adds the frames to the M2 matrix.
+    */
+    void SolveDeferredBatch()
     {
-        // global for this session
-        matrixM2B = (uint8_t *)calloc((_redundancy_max / 8) * _redundancy_max, 1);
+        int k;
+        int words = FRAG_BITS_TO_WORDS(_frame_count);
+        int count = _deferred_count - _solve_next;
+#if FRAG_ENABLE_STATS
+        uint64_t start = StatsClock();
+#endif
 
-        missingFrameIndex = (uint16_t *)calloc(_frame_count, sizeof(uint16_t));
-        for (size_t ix = 0; ix < _frame_count; ix++)
+        if (count > _batch_frames)
         {
-            missingFrameIndex[ix] = 1;
+            count = _batch_frames;
         }
 
-        // these get reset for every frame
-        matrixRow = (bool *)calloc(_frame_count, 1);
-        matrixDataTemp = (uint8_t *)calloc(_frame_size, 1);
-        dataTempVector = (bool *)calloc(_redundancy_max, 1);
-        dataTempVector2 = (bool *)calloc(_redundancy_max, 1);
-        xorRowDataTemp = (uint8_t *)calloc(_frame_size, 1);
-        s = (bool *)calloc(_redundancy_max, 1);
-
-        numberOfLoosingFrame = 0;
-        lastReceiveFrameCnt = 0;
+        // the stored frames are consecutive in the scratch area
+        int r = _flash->read(_batch_data, _scratch_offset + (_solve_next * _frame_size), count * _frame_size);
+        if (r != 0) {
+            tr_warn("Reading frames from the scratch area failed (%d)", r);
+        }
 
-        if (!matrixM2B ||
-            !missingFrameIndex ||
-            !matrixRow ||
-            !matrixDataTemp ||
-            !dataTempVector ||
-            !dataTempVector2 ||
-            !s ||
-            !xorRowDataTemp)
+        for (k = 0; k < count; k++)
         {
-            tr_warn("Could not allocate memory");
-            return false;
+            FragmentationGetParityMatrixRow(_deferred_frames[_solve_next + k] - _frame_count, _frame_count, _batch_rows + (k * words));
         }
+        FRAG_STATS_ADD(_stats, ParityRowsGenerated, count);
 
-        return true;
-    }
+        XorReceivedFragments(count);
 
-    /**
-     * Let the library know that a frame was found.
-     * @param frameCounter
-     */
-    void set_frame_found(uint16_t frameCounter)
-    {
-        missingFrameIndex[frameCounter - 1] = 0;
+        // same frames in the same order, so every frame adds the same row as when it came in
+        for (k = 0; k < count; k++)
+        {
+            memset(dataTempVector, 0, _vector_words * sizeof(frag_word_t));
+            SetMissingBits(_batch_rows + (k * words));
+            memcpy(xorRowDataTemp, _batch_data + (k * _frame_size), _frame_size);
+            AddMatrixM2Row(true);
+        }
 
-        FindMissingReceiveFrame(frameCounter);
+        _solve_next += count;
+
+#if FRAG_ENABLE_STATS
+        _stats.SolveTime += StatsClock() - start;
+#endif
     }
 
-    /**
-     * Process a redundancy frame
-     *
-     * @param frameCounter      The frameCounter for this frame
-     * @param rowData           Binary data of the frame (without LoRaWAN header)
-     * @param sFotaParameter    Current state of the fragmentation session
-     *
-     * @returns FRAG_SESSION_ONGOING if the packets are not completed yet,
-                any other value between 0..FRAG_SESSION_ONGOING if the packet was deconstructed
-     */
-    int process_redundant_frame(uint16_t frameCounter, uint8_t *rowData, FragmentationMathSessionParams_t sFotaParameter)
+    /*!
+    * \brief	XORs the received fragments into a batch of frames in _batch_data, with their parity rows
+    *          in _batch_rows. Every received fragment that is used by the batch is read once, in order.
+    *
+    * \param	[IN] count : number of frames in the batch
+    */
+    void XorReceivedFragments(int count)
     {
+        int k;
         int l;
-        int i;
-        int j;
-        int li;
-        int lj;
-        int firstOneInRow;
-        static int m2l = 0;
-        int first = 0;
-        int noInfo = 0;
-
-        memset(matrixRow, 0, _frame_count);
-        memset(matrixDataTemp, 0, _frame_size);
-        memset(dataTempVector, 0, _redundancy_max);
-        memset(dataTempVector2, 0, _redundancy_max);
-        // we should not mess with rowData
-        memcpy(xorRowDataTemp, rowData, sFotaParameter.DataSize);
-
-        FindMissingReceiveFrame(frameCounter);
-
-        FragmentationGetParityMatrixRow(frameCounter - sFotaParameter.NbOfFrag, sFotaParameter.NbOfFrag, matrixRow); //frameCounter-sFotaParameter.NbOfFrag
+        int words = FRAG_BITS_TO_WORDS(_frame_count);
+        frag_word_t word;
 
-        for (l = 0; l < (sFotaParameter.NbOfFrag); l++)
+        for (int w = 0; w < words; w++)
         {
-            if (matrixRow[l] == 1)
+            word = 0;
+            for (k = 0; k < count; k++)
             {
-                if (missingFrameIndex[l] == 0)
-                { // xor with already receive frame
-                    matrixRow[l] = 0;
-                    GetRowInFlash(l, matrixDataTemp);
-                    XorLineData(xorRowDataTemp, matrixDataTemp, sFotaParameter.DataSize);
+                word |= _batch_rows[(k * words) + w];
+            }
+
+            while (word)
+            {
+                l = (w * FRAG_WORD_BITS) + CountTrailingZeros(word);
+                word &= word - 1;
 
+                if (missingFrameIndex[l] != 0)
+                {
+                    continue;
                 }
-                else
-                { // fill the "little" boolean matrix m2
-                    dataTempVector[missingFrameIndex[l] - 1] = 1;
-                    if (first == 0)
+
+                GetRowInFlash(l, matrixDataTemp);
+                for (k = 0; k < count; k++)
+                {
+                    if (GetBit(_batch_rows + (k * words), l))
                     {
-                        first = 1;
+                        XorLineData(_batch_data + (k * _frame_size), matrixDataTemp, _frame_size);
+                        FRAG_STATS_ADD(_stats, BytesXored, _frame_size);
                     }
                 }
             }
         }
-        firstOneInRow = FindFirstOne(dataTempVector, numberOfLoosingFrame);
-        if (first > 0)
-        { //manage a new line in MatrixM2
-            while (s[firstOneInRow] == 1)
-            { // row already diagonalized exist&(sFotaParameter.MatrixM2[firstOneInRow][0])
-                ExtractLineFromBinaryMatrix(dataTempVector2, firstOneInRow, numberOfLoosingFrame);
-                XorLineBool(dataTempVector, dataTempVector2, numberOfLoosingFrame);
-                li = FindMissingFrameIndex(firstOneInRow); // have to store it in the mi th position of the missing frame
-                GetRowInFlash(li, matrixDataTemp);
-                XorLineData(xorRowDataTemp, matrixDataTemp, sFotaParameter.DataSize);
-                if (VectorIsNull(dataTempVector, numberOfLoosingFrame))
-                {
-                    noInfo = 1;
-                    break;
-                }
-                firstOneInRow = FindFirstOne(dataTempVector, numberOfLoosingFrame);
+    }
+
+    /*!
+    * \brief	Processes a batch of redundancy frames (sorted by frame counter) like ProcessRedundantFrame,
+    *          but with the received fragments XOR'ed in for the whole batch at once
+    */
+    int ProcessRedundantBatch(const uint16_t *frameCounters, uint8_t *const *rowData, int count)
+    {
+        int k;
+        int words = FRAG_BITS_TO_WORDS(_frame_count);
+
+        if (_decoding)
+        {
+            return FRAG_SESSION_DECODING;
+        }
+
+        FRAG_STATS_ADD(_stats, RedundancyFrames, count);
+
+        // the fragments that are missing don't change after the first redundancy frame
+        FindMissingReceiveFrame(frameCounters[count - 1]);
+
+        if (numberOfLoosingFrame > _redundancy_max)
+        {
+            tr_warn("Lost %d frames, more than the %d redundancy frames we can hold", numberOfLoosingFrame, _redundancy_max);
+            return FRAG_SESSION_ONGOING;
+        }
+
+        for (k = 0; k < count; k++)
+        {
+            FragmentationGetParityMatrixRow(frameCounters[k] - _frame_count, _frame_count, _batch_rows + (k * words));
+            memcpy(_batch_data + (k * _frame_size), rowData[k], _frame_size);
+        }
+        FRAG_STATS_ADD(_stats, ParityRowsGenerated, count);
+
+        XorReceivedFragments(count);
+
+        for (k = 0; k < count; k++)
+        {
+            memset(dataTempVector, 0, _vector_words * sizeof(frag_word_t));
+            SetMissingBits(_batch_rows + (k * words));
+            if (VectorIsNull(dataTempVector, numberOfLoosingFrame))
+            {
+                continue;
             }
-            if (noInfo == 0)
+
+            memcpy(xorRowDataTemp, _batch_data + (k * _frame_size), _frame_size);
+            if (AddMatrixM2Row(true))
             {
-                PushLineToBinaryMatrix(dataTempVector, firstOneInRow, numberOfLoosingFrame);
-                li = FindMissingFrameIndex(firstOneInRow);
-                StoreRowInFlash(xorRowDataTemp, li);
-                s[firstOneInRow] = 1;
-                m2l++;
+                FRAG_STATS_ADD(_stats, RowsAdded, 1);
             }
 
             if (m2l == numberOfLoosingFrame)
             { // then last step diagonalized
-                if (numberOfLoosingFrame > 1)
-                {
-                    for (i = (numberOfLoosingFrame - 2); i >= 0; i--)
-                    {
-                        li = FindMissingFrameIndex(i);
-                        GetRowInFlash(li, matrixDataTemp);
-                        for (j = (numberOfLoosingFrame - 1); j > i; j--)
-                        {
-                            ExtractLineFromBinaryMatrix(dataTempVector2, i, numberOfLoosingFrame);
-                            ExtractLineFromBinaryMatrix(dataTempVector, j, numberOfLoosingFrame);
-                            if (dataTempVector2[j] == 1)
-                            {
-                                XorLineBool(dataTempVector2, dataTempVector, numberOfLoosingFrame);
-                                PushLineToBinaryMatrix(dataTempVector2, i, numberOfLoosingFrame);
-
-                                lj = FindMissingFrameIndex(j);
-
-                                GetRowInFlash(lj, xorRowDataTemp);
-                                XorLineData(matrixDataTemp, xorRowDataTemp, sFotaParameter.DataSize);
-                            }
-                        }
-                        StoreRowInFlash(matrixDataTemp, li);
-                    }
-                    return (numberOfLoosingFrame);
-                }
-
-                else
-                { //ifnot ( numberOfLoosingFrame > 1 )
-                    return (numberOfLoosingFrame);
-                }
+                return StartBackSubstitution();
             }
         }
 
         return FRAG_SESSION_ONGOING;
     }
 
-    /**
-     * Get the number of lost frames
-     */
-    int get_lost_frame_count()
-    {
-        return numberOfLoosingFrame;
-    }
-
-  private:
     void GetRowInFlash(int l, uint8_t *rowData)
     {
         int r = _flash->read(rowData, _flash_offset + (l * _frame_size), _frame_size);
@@ -273,37 +1144,166 @@ class FragmentationMath
         }
     }
 
-    void StoreRowInFlash(uint8_t *rowData, int index)
+    void GetMissingRow(int x, int l, uint8_t *rowData)
+    {
+        int r = _rows.read(x, l, rowData);
+        if (r != 0) {
+            tr_warn("GetMissingRow for row %d failed (%d)", l, r);
+        }
+    }
+
+    void StoreMissingRow(uint8_t *rowData, int x, int index, bool final = false)
+    {
+        int r = _rows.write(x, index, rowData, final);
+        if (r != 0) {
+            tr_warn("StoreMissingRow for row %d failed (%d)", index, r);
+        }
+    }
+
+    void FinishMissingRow(int x, int index)
+    {
+        int r = _rows.finish(x, index, matrixDataTemp);
+        if (r != 0) {
+            tr_warn("FinishMissingRow for row %d failed (%d)", index, r);
+        }
+    }
+
+    void FlushMissingRows()
     {
-        int r = _flash->program(rowData, _flash_offset + (_frame_size * index), _frame_size);
+        int r = _rows.flush();
         if (r != 0) {
-            tr_warn("StoreRowInFlash for row %d failed (%d)", index, r);
+            tr_warn("FlushMissingRows failed (%d)", r);
+        }
+    }
+
+    /*!
+     * \brief	Lays the buffers out in one block of memory, every buffer starts at a word boundary
+     *
+     * \param	[IN] memory : block of memory to carve the buffers from, or NULL to only calculate the size
+     * \param	[IN] ram_budget : number of bytes for recovered rows in RAM
+     *
+     * \retval	size of the block in bytes
+     */
+    size_t Layout(uint8_t *memory, size_t ram_budget)
+    {
+        size_t offset = 0;
+
+        // global for this session, one word-aligned row per redundancy packet
+        matrixM2B = (frag_word_t *)Carve(memory, &offset, _vector_words * _redundancy_max * sizeof(frag_word_t));
+        missingFrameIndex = (uint16_t *)Carve(memory, &offset, _frame_count * sizeof(uint16_t));
+        // maps the missing frame ordinal (missingFrameIndex - 1) back to the fragment index
+        missingFrameReverseIndex = (uint16_t *)Carve(memory, &offset, _redundancy_max * sizeof(uint16_t));
+
+        // these get reset for every frame, and can live in scratch space that is shared with other sessions
+        if (_scratch)
+        {
+            matrixRow = memory ? (frag_word_t *)_scratch : NULL;
+            dataTempVector = memory ? matrixRow + FRAG_BITS_TO_WORDS(_frame_count) : NULL;
+            xorRowDataTemp = memory ? (uint8_t *)(dataTempVector + _vector_words) : NULL;
+        }
+        else
+        {
+            matrixRow = (frag_word_t *)Carve(memory, &offset, FRAG_BITS_TO_WORDS(_frame_count) * sizeof(frag_word_t));
+            dataTempVector = (frag_word_t *)Carve(memory, &offset, _vector_words * sizeof(frag_word_t));
+            xorRowDataTemp = Carve(memory, &offset, _frame_size);
+        }
+        // holds the row that is being back-substituted between calls, so it's never shared
+        matrixDataTemp = Carve(memory, &offset, _frame_size);
+        s = (frag_word_t *)Carve(memory, &offset, _vector_words * sizeof(frag_word_t));
+
+        // frame counters of the stored frames, and a batch of frames during the solve or in process_redundant_frames
+        _deferred_frames = (uint16_t *)Carve(memory, &offset, _deferred ? _redundancy_max * sizeof(uint16_t) : 0);
+        _batch_data = Carve(memory, &offset, (_deferred || _batched) ? _batch_frames * _frame_size : 0);
+        _batch_rows = (frag_word_t *)Carve(memory, &offset, (_deferred || _batched) ? _batch_frames * FRAG_BITS_TO_WORDS(_frame_count) * sizeof(frag_word_t) : 0);
+
+        // rows that were added since the last checkpoint
+        _ckpt_rows = (frag_word_t *)Carve(memory, &offset, _journal ? _vector_words * sizeof(frag_word_t) : 0);
+
+        uint8_t *rows = Carve(memory, &offset, FragmentationRowStore::get_memory_size(ram_budget, _redundancy_max, _frame_size));
+        if (memory)
+        {
+            _rows.initialize(ram_budget, _redundancy_max, rows);
+        }
+
+        return offset;
+    }
+
+    static uint8_t *Carve(uint8_t *memory, size_t *offset, size_t size)
+    {
+        uint8_t *buffer = (memory && size) ? memory + *offset : NULL;
+        *offset += FRAG_ALIGN_SIZE(size);
+        return buffer;
+    }
+
+    void FreeBuffers()
+    {
+        if (_memory_owned)
+        {
+            free(_memory);
+        }
+        _memory = NULL;
+        _memory_size = 0;
+        _memory_owned = false;
+        _rows.initialize(0, 0, NULL);
+
+        matrixM2B = NULL;
+        missingFrameIndex = NULL;
+        missingFrameReverseIndex = NULL;
+        matrixRow = NULL;
+        matrixDataTemp = NULL;
+        dataTempVector = NULL;
+        s = NULL;
+        xorRowDataTemp = NULL;
+        _deferred_frames = NULL;
+        _batch_data = NULL;
+        _batch_rows = NULL;
+        _ckpt_rows = NULL;
+    }
+
+    void MarkMissingChanged(uint32_t first, uint32_t end)
+    {
+        if (end > _frame_count)
+        {
+            end = _frame_count;
+        }
+        if (first < _ckpt_missing_first)
+        {
+            _ckpt_missing_first = first;
+        }
+        if (end > _ckpt_missing_end)
+        {
+            _ckpt_missing_end = end;
         }
     }
 
     uint16_t FindMissingFrameIndex(uint16_t x)
     {
-        uint16_t i;
-        for (i = 0; i < _frame_count; i++)
+        if (x >= _redundancy_max)
         {
-            if (missingFrameIndex[i] == (x + 1))
-            {
-                return (i);
-            }
+            return (0);
         }
-        return (0);
+        return missingFrameReverseIndex[x];
     }
 
     void FindMissingReceiveFrame(uint16_t frameCounter)
     {
         uint16_t q;
 
+        if (lastReceiveFrameCnt < frameCounter - 1)
+        {
+            MarkMissingChanged(lastReceiveFrameCnt, frameCounter - 1);
+        }
+
         for (q = lastReceiveFrameCnt; q < (frameCounter - 1); q++)
         {
             if (q < _frame_count)
             {
                 numberOfLoosingFrame++;
                 missingFrameIndex[q] = numberOfLoosingFrame;
+                if (numberOfLoosingFrame <= _redundancy_max)
+                {
+                    missingFrameReverseIndex[numberOfLoosingFrame - 1] = q;
+                }
             }
         }
         if (q < _frame_count)
@@ -322,87 +1322,100 @@ class FragmentationMath
     * \param	[IN] dataL1 and dataL2
     * \param    [IN] size : number of Bytes in dataL1
     * \param	[OUT] xor(dataL1,dataL2) in dataL1
+    *
+    * Works in place. Uses 128-bit vectors on hosts with SSE2 or NEON, and
+    * machine words when both lines share the same alignment.
     */
-    void XorLineData(uint8_t *dataL1, uint8_t *dataL2, int size)
+    static void XorLineData(uint8_t *dataL1, const uint8_t *dataL2, int size)
     {
-        int i;
-        uint8_t *dataTemp = (uint8_t *)malloc(size);
-        if (!dataTemp) {
-            tr_warn("XorLineData malloc out of memory!");
-            return;
+        int i = 0;
+
+#if defined(__SSE2__)
+        for (; i + 16 <= size; i += 16)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(dataL1 + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(dataL2 + i));
+            _mm_storeu_si128((__m128i *)(dataL1 + i), _mm_xor_si128(a, b));
+        }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        for (; i + 16 <= size; i += 16)
+        {
+            vst1q_u8(dataL1 + i, veorq_u8(vld1q_u8(dataL1 + i), vld1q_u8(dataL2 + i)));
         }
+#endif
 
-        for (i = 0; i < size; i++)
+        if ((((uintptr_t)(dataL1 + i)) % sizeof(frag_word_t)) == (((uintptr_t)(dataL2 + i)) % sizeof(frag_word_t)))
         {
-            dataTemp[i] = dataL1[i] ^ dataL2[i];
+            // unaligned head
+            for (; i < size && (((uintptr_t)(dataL1 + i)) % sizeof(frag_word_t)) != 0; i++)
+            {
+                dataL1[i] ^= dataL2[i];
+            }
+
+            frag_alias_word_t *wordL1 = (frag_alias_word_t *)(dataL1 + i);
+            const frag_alias_word_t *wordL2 = (const frag_alias_word_t *)(dataL2 + i);
+            int words = (size - i) / (int)sizeof(frag_word_t);
+            for (int w = 0; w < words; w++)
+            {
+                wordL1[w] ^= wordL2[w];
+            }
+            i += words * sizeof(frag_word_t);
         }
-        for (i = 0; i < size; i++)
+
+        // tail, or everything when the alignment differs
+        for (; i < size; i++)
         {
-            dataL1[i] = dataTemp[i];
+            dataL1[i] ^= dataL2[i];
         }
-        free(dataTemp);
     }
 
     /*!
-    * \brief	Function to xor two line of data
+    * \brief	Function to xor two packed GF(2) vectors
     *
     * \param	[IN] dataL1 and dataL2
-    * \param    [IN] size : number of bool in dataL1
+    * \param    [IN] size : number of bits in dataL1
     * \param	[OUT] xor(dataL1,dataL2) store in dataL1
     */
-    void XorLineBool(bool *dataL1, bool *dataL2, int size)
+    void XorLineBool(frag_word_t *dataL1, const frag_word_t *dataL2, int size)
     {
         int i;
-        bool *dataTemp = (bool *)malloc(size);
-        if (!dataTemp) {
-            tr_warn("XorLineBool malloc failed");
-            return;
-        }
-
-        for (i = 0; i < size; i++)
-        {
-            dataTemp[i] = dataL1[i] ^ dataL2[i];
-        }
-        for (i = 0; i < size; i++)
+        for (i = 0; i < (int)FRAG_BITS_TO_WORDS(size); i++)
         {
-            dataL1[i] = dataTemp[i];
+            dataL1[i] ^= dataL2[i];
         }
-
-        free(dataTemp);
     }
 
     /*!
-    * \brief	Function to find the first one in a bolean vector
+    * \brief	Function to find the first one in a packed GF(2) vector
     *
-    * \param	[IN] bool vector and size of vector
+    * \param	[IN] packed vector and size of vector in bits
     * \param	[OUT] the position of the first one in the row vector
     */
-
-    int FindFirstOne(bool *boolData, int size)
+    int FindFirstOne(const frag_word_t *boolData, int size)
     {
         int i;
-        for (i = 0; i < size; i++)
+        for (i = 0; i < (int)FRAG_BITS_TO_WORDS(size); i++)
         {
-            if (boolData[i] == 1)
+            if (boolData[i])
             {
-                return i;
+                return (i * FRAG_WORD_BITS) + CountTrailingZeros(boolData[i]);
             }
         }
         return 0;
     }
 
     /*!
-    * \brief	Function to test if a vector is null
+    * \brief	Function to test if a packed GF(2) vector is null
     *
-    * \param	[IN] bool vector and size of vector
+    * \param	[IN] packed vector and size of vector in bits
     * \param	[OUT] bool : true if vector is null
     */
-    bool VectorIsNull(bool *boolData, int size)
+    bool VectorIsNull(const frag_word_t *boolData, int size)
     {
         int i;
-        for (i = 0; i < size; i++)
+        for (i = 0; i < (int)FRAG_BITS_TO_WORDS(size); i++)
         {
-            if (boolData[i] == 1)
+            if (boolData[i])
             {
                 return false;
             }
@@ -411,83 +1424,43 @@ class FragmentationMath
     }
 
     /*!
- * \brief	Function extact a row from the binary matrix and expand to a bool vector
- *
- * \param	[IN] row number
- * \param	[IN] bool vector, number of Bits in one row
- */
-    void ExtractLineFromBinaryMatrix(bool *boolVector, int rownumber, int numberOfBit)
+    * \brief	Function to get a row of the binary matrix M2. Row x only has bits set from column x onwards.
+    *
+    * \param	[IN] row number
+    * \param	[OUT] packed vector of _redundancy_max bits
+    */
+    frag_word_t *MatrixM2Line(int rownumber)
     {
-        int i;
-        int findByte;
-        int findBitInByte;
-        if (rownumber > 0)
-        {
-            findByte = (rownumber * numberOfBit - ((rownumber * (rownumber - 1)) / 2)) / 8;
-            findBitInByte = (rownumber * numberOfBit - ((rownumber * (rownumber - 1)) / 2)) % 8;
-        }
-        else
-        {
-            findByte = 0;
-            findBitInByte = 0;
-        }
-        if (rownumber > 0)
-        {
-            for (i = 0; i < rownumber; i++)
-            {
-                boolVector[i] = 0;
-            }
-        }
-        for (i = rownumber; i < numberOfBit; i++)
-        {
-            boolVector[i] = (matrixM2B[findByte] >> (7 - findBitInByte)) & 0x01;
-            findBitInByte++;
-            if (findBitInByte == 8)
-            {
-                findBitInByte = 0;
-                findByte++;
-            }
-        }
+        return matrixM2B + (rownumber * _vector_words);
     }
 
-    /*!
- * \brief	Function Collapse and Push  a row vector to the binary matrix
- *
- * \param	[IN] row number
- * \param	[IN] bool vector, number of Bits in one row
- */
-    void PushLineToBinaryMatrix(bool *boolVector, int rownumber, int numberOfBit)
+    static bool GetBit(const frag_word_t *vector, int bit)
     {
-        int i;
-        int findByte;
-        int findBitInByte;
-        if (rownumber > 0)
-        {
-            findByte = (rownumber * numberOfBit - ((rownumber * (rownumber - 1)) / 2)) / 8;
-            findBitInByte = (rownumber * numberOfBit - ((rownumber * (rownumber - 1)) / 2)) % 8;
-        }
-        else
-        {
-            findByte = 0;
-            findBitInByte = 0;
-        }
-        for (i = rownumber; i < numberOfBit; i++)
+        return (vector[bit / FRAG_WORD_BITS] >> (bit % FRAG_WORD_BITS)) & 1;
+    }
+
+    static void SetBit(frag_word_t *vector, int bit)
+    {
+        vector[bit / FRAG_WORD_BITS] |= ((frag_word_t)1) << (bit % FRAG_WORD_BITS);
+    }
+
+    static int CountTrailingZeros(frag_word_t word)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+#if FRAG_WORD_BITS == 64
+        return __builtin_ctzll(word);
+#else
+        return __builtin_ctz(word);
+#endif
+#else
+        int n = 0;
+        while (!(word & 1))
         {
-            if (boolVector[i] == 1)
-            {
-                matrixM2B[findByte] = (matrixM2B[findByte] & (0xFF - (1 << (7 - findBitInByte)))) + (1 << (7 - findBitInByte));
-            }
-            else
-            {
-                matrixM2B[findByte] = (matrixM2B[findByte] & (0xFF - (1 << (7 - findBitInByte))));
-            }
-            findBitInByte++;
-            if (findBitInByte == 8)
-            {
-                findBitInByte = 0;
-                findByte++;
-            }
+            word >>= 1;
+            n++;
         }
+        return n;
+#endif
     }
 
     /*!
@@ -497,9 +1470,8 @@ class FragmentationMath
  * \param	[IN] M - the size of the row to be calculted, the number of uncoded fragments used in the scheme,matrixRow - pointer to the boolean array
  * \param	[OUT] void
  */
-    void FragmentationGetParityMatrixRow(int N, int M, bool *matrixRow)
+    static void FragmentationGetParityMatrixRow(int N, int M, frag_word_t *matrixRow)
     {
-
         int i;
         int m;
         int x;
@@ -514,7 +1486,7 @@ class FragmentationMath
             m = 0;
         }
         x = 1 + (1001 * N);
-        for (i = 0; i < M; i++)
+        for (i = 0; i < (int)FRAG_BITS_TO_WORDS(M); i++)
         {
             matrixRow[i] = 0;
         }
@@ -526,7 +1498,7 @@ class FragmentationMath
                 x = FragmentationPrbs23(x);
                 r = x % (M + m);
             }
-            matrixRow[r] = 1;
+            SetBit(matrixRow, r);
             nbCoeff += 1;
         }
     }
@@ -535,11 +1507,11 @@ class FragmentationMath
  * \brief	Pseudo random number generator : prbs23
  * \param	[IN] x - the input of the prbs23 generator
  */
-    int FragmentationPrbs23(int x)
+    static int FragmentationPrbs23(int x)
     {
         int b0 = x & 1;
         int b1 = (x & 0x20) >> 5;
-        x = (int)floor((double)x / 2) + ((b0 ^ b1) << 22);
+        x = (x >> 1) + ((b0 ^ b1) << 22); // x is never negative, so this is floor(x / 2)
         return x;
     }
     /*!
@@ -548,24 +1520,9 @@ class FragmentationMath
  * \param	[IN]  input variable to be tested
  * \param	[OUT] return true if x is a power of two
  */
-    bool IsPowerOfTwo(unsigned int x)
+    static bool IsPowerOfTwo(unsigned int x)
     {
-        int i;
-        int bi;
-        int sumBit = 0;
-        for (i = 0; i < 32; i++)
-        {
-            bi = 1 << i;
-            sumBit += (x & bi) >> i;
-        }
-        if (sumBit == 1)
-        {
-            return (true);
-        }
-        else
-        {
-            return (false);
-        }
+        return (x != 0) && ((x & (x - 1)) == 0);
     }
 
     FragmentationBlockDeviceWrapper *_flash;
@@ -573,19 +1530,58 @@ class FragmentationMath
     uint8_t _frame_size;
     uint16_t _redundancy_max;
     size_t _flash_offset;
+    size_t _vector_words;
 
-    uint8_t *matrixM2B;
+    frag_word_t *matrixM2B;
     uint16_t *missingFrameIndex;
+    uint16_t *missingFrameReverseIndex;
 
-    bool *matrixRow;
+    frag_word_t *matrixRow;
     uint8_t *matrixDataTemp;
-    bool *dataTempVector;
-    bool *dataTempVector2;
-    bool *s;
+    frag_word_t *dataTempVector;
+    frag_word_t *s;
     uint8_t *xorRowDataTemp;
 
     int numberOfLoosingFrame;
     int lastReceiveFrameCnt;
+    int m2l; // number of rows in the M2 matrix
+
+    bool _resumable; // back-substitution runs through back_substitute() instead of process_redundant_frame()
+    bool _decoding;  // back-substitution started but not finished
+    int _bs_row;     // row that is being back-substituted
+    int _bs_column;  // next column to check in _bs_row
+
+    bool _deferred;               // store redundancy frames and solve once there are enough
+    size_t _scratch_offset;       // place in flash where the frames are stored
+    int _batch_frames;            // number of stored frames that are eliminated in one pass
+    int _deferred_count;          // number of stored frames
+    int _solve_next;              // next stored frame to eliminate
+    uint16_t *_deferred_frames;   // frame counters of the stored frames
+    uint8_t *_batch_data;         // data of the batch that is being eliminated
+    frag_word_t *_batch_rows;     // parity rows of the batch that is being eliminated
+    bool _batched;                // process_redundant_frames eliminates frames in batches
+
+    FragmentationCheckpoint *_journal;  // journal that checkpoints are written to, NULL if not used
+    frag_word_t *_ckpt_rows;            // rows added to M2 since the last checkpoint
+    uint32_t _ckpt_missing_first;       // range of missingFrameIndex that changed since the last checkpoint
+    uint32_t _ckpt_missing_end;
+    uint16_t _ckpt_lost;                // entries of missingFrameReverseIndex in the last checkpoint
+    uint16_t _ckpt_deferred;            // stored frames in the last checkpoint
+
+    uint8_t *_scratch;                  // caller-owned space for matrixRow, dataTempVector and xorRowDataTemp
+
+    uint8_t *_arena;                    // caller-owned memory for the buffers, or NULL to use the heap
+    size_t _arena_size;
+    uint8_t *_memory;                   // block that the buffers are carved from
+    size_t _memory_size;
+    bool _memory_owned;                 // _memory was allocated on the heap
+
+    FragmentationRowStore _rows; // data rows of the missing frames
+
+#if FRAG_ENABLE_STATS
+    FragmentationStats_t _stats;
+    frag_stats_clock_t _clock;
+#endif
 };
 
 #endif // _MBEDFRAG_FRAGMENTATION_MATH_H
@@ -0,0 +1,227 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_FRAGMENTATION_ROW_STORE_H
+#define _MBEDFRAG_FRAGMENTATION_ROW_STORE_H
+
+/**
+ * Holds the rows for the fragments that were lost while they are being
+ * recovered from the redundancy frames. A row is addressed by its slot (the
+ * missing frame ordinal in FragmentationMath) and its fragment index.
+ *
+ * The first rows (as many as fit in the RAM budget) are kept in RAM, the
+ * rest is kept in flash at the place of the fragment. Rows in RAM are only
+ * written to flash when 'flush' is called, once they are final, so they
+ * cause no scratch traffic on the flash.
+ *
+ * With a spill area the rows in flash are kept there, by slot, until they
+ * are final. Then every place in flash is programmed once, which flash that
+ * needs an erase before it's programmed again requires.
+ */
+
+#include "mbed.h"
+#include "FragmentationBlockDeviceWrapper.h"
+
+#include "mbed_trace.h"
+#undef TRACE_GROUP
+#define TRACE_GROUP "FROW"
+
+// Memory that FragmentationRowStore::initialize needs, as a constant expression
+#define FRAG_ROW_STORE_RAM_ROWS(ram_budget, max_rows, row_size) \
+    ((row_size) == 0 ? 0 : ((ram_budget) / (row_size) > (max_rows) ? (max_rows) : (ram_budget) / (row_size)))
+#define FRAG_ROW_STORE_MEMORY_SIZE(ram_budget, max_rows, row_size) \
+    (FRAG_ROW_STORE_RAM_ROWS(ram_budget, max_rows, row_size) * (sizeof(uint16_t) + (row_size)))
+
+class FragmentationRowStore {
+public:
+    /**
+     * @param flash         Instance of wrapped BlockDevice
+     * @param flash_offset  Place in flash where the binary is placed
+     * @param row_size      Size of a row (the fragment size)
+     */
+    FragmentationRowStore(FragmentationBlockDeviceWrapper *flash, size_t flash_offset, uint8_t row_size)
+        : _flash(flash), _flash_offset(flash_offset), _row_size(row_size),
+          _spill(false), _spill_offset(0), _final_from(0),
+          _ram_rows(0), _ram_buffer(NULL), _ram_index(NULL)
+    {
+    }
+
+    /**
+     * Number of bytes that initialize needs for a RAM budget
+     *
+     * @param ram_budget    Number of bytes to use for rows in RAM
+     * @param max_rows      Maximum number of rows that are needed
+     * @param row_size      Size of a row
+     */
+    static size_t get_memory_size(size_t ram_budget, uint16_t max_rows, uint8_t row_size) {
+        return FRAG_ROW_STORE_MEMORY_SIZE(ram_budget, (size_t)max_rows, (size_t)row_size);
+    }
+
+    /**
+     * Move the rows in flash to another place, call 'initialize' afterwards
+     */
+    void set_layout(size_t flash_offset, uint8_t row_size) {
+        _flash_offset = flash_offset;
+        _row_size = row_size;
+    }
+
+    /**
+     * Keep the rows in flash in a spill area until they are final
+     *
+     * @param spill_offset  Place in flash of the spill area, needs room for max_rows * row_size bytes
+     */
+    void set_spill(size_t spill_offset) {
+        _spill = true;
+        _spill_offset = spill_offset;
+    }
+
+    /**
+     * Set up the rows that are kept in RAM
+     *
+     * @param ram_budget    Number of bytes to use for rows in RAM, 0 to keep all rows in flash
+     * @param max_rows      Maximum number of rows that are needed
+     * @param memory        get_memory_size() bytes, aligned to 2 bytes, that hold the rows in RAM
+     */
+    void initialize(size_t ram_budget, uint16_t max_rows, uint8_t *memory) {
+        _ram_rows = memory ? FRAG_ROW_STORE_RAM_ROWS(ram_budget, (size_t)max_rows, (size_t)_row_size) : 0;
+        _ram_index = (uint16_t*)memory;
+        _ram_buffer = memory ? memory + (_ram_rows * sizeof(uint16_t)) : NULL;
+        _final_from = 0xffff;
+
+        for (size_t ix = 0; ix < _ram_rows; ix++) {
+            _ram_index[ix] = FRAG_ROW_UNUSED;
+        }
+    }
+
+    /**
+     * Read a row
+     *
+     * @param slot      Slot of the row
+     * @param index     Fragment index of the row (0-based)
+     * @param data      Buffer of row_size bytes
+     */
+    int read(uint16_t slot, uint16_t index, uint8_t *data) {
+        if (slot < _ram_rows) {
+            memcpy(data, _ram_buffer + (slot * _row_size), _row_size);
+            return BD_ERROR_OK;
+        }
+
+        return read_flash(slot, index, data);
+    }
+
+    /**
+     * Read a row from flash, where it is kept when it's not in RAM
+     *
+     * @param slot      Slot of the row
+     * @param index     Fragment index of the row (0-based)
+     * @param data      Buffer of row_size bytes
+     */
+    int read_flash(uint16_t slot, uint16_t index, uint8_t *data) {
+        if (_spill && slot < _final_from) {
+            return _flash->read(data, _spill_offset + (slot * _row_size), _row_size);
+        }
+
+        return _flash->read(data, _flash_offset + (index * _row_size), _row_size);
+    }
+
+    /**
+     * Write a row
+     *
+     * @param slot      Slot of the row
+     * @param index     Fragment index of the row (0-based)
+     * @param data      Buffer of row_size bytes
+     * @param final     The row does not change anymore. Rows become final from the last slot down.
+     */
+    int write(uint16_t slot, uint16_t index, const uint8_t *data, bool final = false) {
+        if (slot < _ram_rows) {
+            memcpy(_ram_buffer + (slot * _row_size), data, _row_size);
+            _ram_index[slot] = index;
+            return BD_ERROR_OK;
+        }
+
+        if (_spill && !final) {
+            return _flash->program(data, _spill_offset + (slot * _row_size), _row_size);
+        }
+
+        if (final) {
+            _final_from = slot;
+        }
+        return _flash->program(data, _flash_offset + (index * _row_size), _row_size);
+    }
+
+    /**
+     * Mark a row final without changing it, a row in the spill area is moved to the place of the fragment
+     *
+     * @param slot      Slot of the row
+     * @param index     Fragment index of the row (0-based)
+     * @param buffer    Buffer of row_size bytes that is used to move the row
+     */
+    int finish(uint16_t slot, uint16_t index, uint8_t *buffer) {
+        if (slot < _ram_rows || !_spill) {
+            _final_from = slot;
+            return BD_ERROR_OK;
+        }
+
+        int r = read_flash(slot, index, buffer);
+        if (r != 0) return r;
+        return write(slot, index, buffer, true);
+    }
+
+    /**
+     * Write the rows that are in RAM to their place in flash
+     */
+    int flush() {
+        for (size_t ix = 0; ix < _ram_rows; ix++) {
+            if (_ram_index[ix] == FRAG_ROW_UNUSED) continue;
+
+            int r = _flash->program(_ram_buffer + (ix * _row_size), _flash_offset + (_ram_index[ix] * _row_size), _row_size);
+            if (r != 0) return r;
+        }
+        return BD_ERROR_OK;
+    }
+
+    /**
+     * Number of rows that are kept in RAM
+     */
+    uint16_t get_ram_rows() {
+        return _ram_rows;
+    }
+
+    /**
+     * Whether rows in flash are kept in a spill area until they are final
+     */
+    bool has_spill() {
+        return _spill;
+    }
+
+private:
+    static const uint16_t FRAG_ROW_UNUSED = 0xffff;
+
+    FragmentationBlockDeviceWrapper *_flash;
+    size_t _flash_offset;
+    uint8_t _row_size;
+
+    bool _spill;            // rows in flash are kept in the spill area until they are final
+    size_t _spill_offset;
+    uint16_t _final_from;   // rows from this slot on are final, and read from the place of the fragment
+
+    uint16_t _ram_rows;
+    uint8_t *_ram_buffer;
+    uint16_t *_ram_index;
+};
+
+#endif // _MBEDFRAG_FRAGMENTATION_ROW_STORE_H
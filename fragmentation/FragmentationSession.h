@@ -22,9 +22,13 @@
 #include "BlockDevice.h"
 #include "FragmentationBlockDeviceWrapper.h"
 #include "FragmentationMath.h"
+#include "FragmentationStats.h"
+#include "FragmentationCheckpoint.h"
+#include "FragmentationVerifier.h"
 #include "mbed_debug.h"
 
 #include "mbed_trace.h"
+#undef TRACE_GROUP
 #define TRACE_GROUP "FSES"
 
 /**
@@ -45,7 +49,56 @@ enum FragResult {
     FRAG_SIZE_INCORRECT,
     FRAG_FLASH_WRITE_ERROR,
     FRAG_NO_MEMORY,
-    FRAG_COMPLETE
+    FRAG_COMPLETE,
+    FRAG_FLASH_READ_ERROR,
+    FRAG_DECODING,
+    FRAG_NO_CHECKPOINT,
+    FRAG_NO_SESSION
+};
+
+/**
+ * First record of a checkpoint journal, a journal is only resumed by a session with the same options
+ */
+typedef struct {
+    uint32_t FlashOffset;
+    uint32_t ScratchOffset;     // 0xffffffff if the session does not use deferred decoding
+    uint32_t SpillOffset;       // 0xffffffff if the session has no spill area
+    uint16_t NumberOfFragments;
+    uint16_t RedundancyPackets;
+    uint16_t WordBits;          // FRAG_WORD_BITS, the M2 matrix is stored as is
+    uint8_t  FragmentSize;
+    uint8_t  Padding;
+} FragmentationSessionCheckpoint_t;
+
+/**
+ * Session state in a checkpoint, followed by the state of FragmentationMath
+ */
+typedef struct {
+    uint32_t FramesReceived;
+    uint32_t EraseNext;
+} FragmentationSessionState_t;
+
+/**
+ * A frame for FragmentationSession::process_frames
+ */
+typedef struct {
+    uint16_t       Index;   // The index of the frame
+    const uint8_t* Buffer;  // The contents of the frame (without the fragindex bytes)
+    size_t         Size;    // The size of the buffer
+} FragmentationFrame_t;
+
+// Number of frames that process_frames sorts and processes at a time, the bookkeeping lives on the stack
+#ifndef FRAG_SESSION_BATCH_FRAMES
+#define FRAG_SESSION_BATCH_FRAMES   16
+#endif
+
+/**
+ * How the flash area that holds the binary is erased
+ */
+enum FragEraseMode {
+    FRAG_ERASE_NONE,        // don't erase, the block device needs to tolerate reprogramming
+    FRAG_ERASE_UPFRONT,     // erase the whole area in initialize()
+    FRAG_ERASE_BACKGROUND   // erase one sector per frame, and always ahead of the data that is written
 };
 
 /**
@@ -61,56 +114,387 @@ public:
     FragmentationSession(FragmentationBlockDeviceWrapper* flash, FragmentationSessionOpts_t opts)
         : _flash(flash), _opts(opts),
           _math(flash, opts.NumberOfFragments, opts.FragmentSize, opts.RedundancyPackets, opts.FlashOffset),
-          _frames_received(0)
+          _frames_received(0), _erase_next(0), _erase_end(0), _deferred(false), _scratch_offset(0), _spill(false), _spill_offset(0), _journal(flash),
+          _verifier(NULL)
     {
+#if FRAG_ENABLE_STATS
+        memset(&_flash_stats, 0, sizeof(_flash_stats));
+#endif
+
         tr_debug("FragmentationSession starting:");
         tr_debug("\tNumberOfFragments:   %d", opts.NumberOfFragments);
         tr_debug("\tFragmentSize:        %d", opts.FragmentSize);
         tr_debug("\tPadding:             %d", opts.Padding);
         tr_debug("\tMaxRedundancy:       %d", opts.RedundancyPackets);
-        tr_debug("\tFlashOffset:         0x%x", opts.FlashOffset);
+        tr_debug("\tFlashOffset:         0x%lx", (unsigned long)opts.FlashOffset);
     }
 
     /**
      * Allocate the required buffers for the fragmentation session, and clears the flash pages required for the binary file.
      *
+     * Erasing covers every erase sector that overlaps with FlashOffset .. FlashOffset + NumberOfFragments * FragmentSize,
+     * so keep the binary aligned to the erase size if other data lives in the same sectors.
+     *
+     * @param erase_mode    Whether to erase the flash area up front, in the background or not at all
+     * @param ram_budget    Bytes of RAM that may be used to hold the fragments that are recovered from redundancy frames.
+     *                      These fragments are then written to flash once, when the session completes,
+     *                      instead of being rewritten while decoding. Fragments beyond the budget are kept in flash,
+     *                      in the spill area if set_spill_area was called.
+     *
      * @returns FRAG_OK if succeeded,
      *          FRAG_NO_MEMORY if allocations failed,
      *          FRAG_FLASH_WRITE_ERROR if clearing the flash failed.
     */
-    FragResult initialize() {
-        if (_flash->init() != BD_ERROR_OK) {
-            tr_warn("Could not initialize FragmentationBlockDeviceWrapper");
-            return FRAG_NO_MEMORY;
+    FragResult initialize(FragEraseMode erase_mode = FRAG_ERASE_NONE, size_t ram_budget = 0) {
+        FragResult result = setup(erase_mode, ram_budget);
+        if (result != FRAG_OK) {
+            return result;
         }
 
-        // initialize the memory required for the Math module
-        if (!_math.initialize()) {
-            tr_warn("Could not initialize FragmentationMath");
-            return FRAG_NO_MEMORY;
+        if (erase_mode == FRAG_ERASE_UPFRONT) {
+            if (!erase_until(_erase_end)) {
+                return FRAG_FLASH_WRITE_ERROR;
+            }
+        }
+
+        // frames are stored in the scratch area as they come in, so it's always erased up front
+        if (_deferred && erase_mode != FRAG_ERASE_NONE) {
+            int r = _flash->erase(_scratch_offset, _opts.RedundancyPackets * _opts.FragmentSize);
+            if (r != 0) {
+                tr_warn("Erasing the scratch area failed (%d)", r);
+                return FRAG_FLASH_WRITE_ERROR;
+            }
+        }
+
+        // so are the recovered fragments that are spilled
+        if (_spill && erase_mode != FRAG_ERASE_NONE) {
+            int r = _flash->erase(_spill_offset, _opts.RedundancyPackets * _opts.FragmentSize);
+            if (r != 0) {
+                tr_warn("Erasing the spill area failed (%d)", r);
+                return FRAG_FLASH_WRITE_ERROR;
+            }
+        }
+
+        // a new session, so anything that was in the journal is gone
+        if (_journal.get_size() > 0 && start_journal() != 0) {
+            return FRAG_FLASH_WRITE_ERROR;
         }
 
         return FRAG_OK;
     }
 
+    /**
+     * Same as initialize(), but all buffers of the session are carved out of caller-owned memory instead of
+     * being allocated on the heap. The arena is used by this session until it's destroyed, also by reset().
+     *
+     * @param arena         Memory for the buffers
+     * @param arena_size    Size of the arena, at least get_required_memory(ram_budget) bytes,
+     *                      plus sizeof(frag_word_t) - 1 if the arena is not word-aligned
+     * @param erase_mode    Whether to erase the flash area up front, in the background or not at all
+     * @param ram_budget    Bytes of RAM (in the arena) that may be used to hold the fragments that are recovered
+     *
+     * @returns FRAG_OK if succeeded,
+     *          FRAG_NO_MEMORY if the arena is too small,
+     *          FRAG_FLASH_WRITE_ERROR if clearing the flash failed.
+     */
+    FragResult initialize(uint8_t* arena, size_t arena_size, FragEraseMode erase_mode = FRAG_ERASE_NONE, size_t ram_budget = 0) {
+        set_arena(arena, arena_size);
+        return initialize(erase_mode, ram_budget);
+    }
+
+    /**
+     * Carve the buffers of the session out of caller-owned memory in every following call to initialize(), resume() or reset()
+     *
+     * @param arena         Memory for the buffers, or NULL to allocate them on the heap
+     * @param arena_size    Size of the arena, see initialize()
+     */
+    void set_arena(uint8_t* arena, size_t arena_size) {
+        _math.set_arena(arena, arena_size);
+    }
+
+    /**
+     * Start a new session with other options, reusing the memory of this session. The heap memory is only
+     * reallocated if the new session needs more than the previous one, an arena is always reused.
+     * Deferred decoding, step decoding, the spill area and checkpoints stay configured, their regions in flash need to fit the new options.
+     *
+     * @param opts          List of options for the new session
+     * @param erase_mode    Same as for initialize()
+     * @param ram_budget    Same as for initialize()
+     *
+     * @returns the same as initialize()
+     */
+    FragResult reset(FragmentationSessionOpts_t opts, FragEraseMode erase_mode = FRAG_ERASE_NONE, size_t ram_budget = 0) {
+        _opts = opts;
+        _math.set_parameters(opts.NumberOfFragments, opts.FragmentSize, opts.RedundancyPackets, opts.FlashOffset);
+        return initialize(erase_mode, ram_budget);
+    }
+
+    /**
+     * Bytes of memory that initialize() allocates for a session with these options, without deferred decoding
+     * or checkpoints. FRAG_MATH_MEMORY_SIZE gives the same number (without RAM budget) as a constant expression.
+     *
+     * @param opts          List of options for the session
+     * @param ram_budget    Same as for initialize()
+     */
+    static size_t required_memory(FragmentationSessionOpts_t opts, size_t ram_budget = 0) {
+        return FRAG_MATH_MEMORY_SIZE(opts.NumberOfFragments, opts.FragmentSize, opts.RedundancyPackets)
+            + FRAG_ALIGN_SIZE(FragmentationRowStore::get_memory_size(ram_budget, opts.RedundancyPackets, opts.FragmentSize));
+    }
+
+    /**
+     * Bytes of memory that initialize() allocates for this session, including the buffers for
+     * deferred decoding and checkpoints, and without the scratch space if it's shared
+     *
+     * @param ram_budget    Same as for initialize()
+     */
+    size_t get_required_memory(size_t ram_budget = 0) {
+        return _math.get_memory_size(ram_budget);
+    }
+
+    /**
+     * Keep checkpoints of this session in a reserved region of the block device, so it can be resumed
+     * after a reboot through resume(). Call before initialize() or resume().
+     *
+     * The region is erased in initialize(), and when it's full (then it's rewritten with a single checkpoint).
+     *
+     * @param offset    Place in flash for the checkpoints, should not overlap with the binary or the scratch area
+     * @param size      Size of the region, at least get_checkpoint_size(). A few times that keeps rewrites rare.
+     */
+    void set_checkpoint(size_t offset, size_t size) {
+        _journal.set_region(offset, size);
+        _math.set_checkpoint(size > 0 ? &_journal : NULL);
+    }
+
+    /**
+     * Write the state that changed since the last checkpoint to flash. This includes syncing the block device wrapper,
+     * so the fragments that were received so far are on the block device as well.
+     * Checkpoints are cheap (a few bytes per frame since the last one), so they can be written every couple of frames.
+     *
+     * @returns FRAG_OK if succeeded,
+     *          FRAG_DECODING if the binary is being reconstructed, no checkpoints are made from here,
+     *          FRAG_NO_CHECKPOINT if set_checkpoint was not called,
+     *          FRAG_FLASH_WRITE_ERROR if writing the checkpoint failed
+     */
+    FragResult checkpoint() {
+        if (_journal.get_size() == 0) return FRAG_NO_CHECKPOINT;
+        if (_math.is_decoding()) return FRAG_DECODING;
+
+        int r = write_checkpoint(false);
+        if (r == FRAG_CHECKPOINT_FULL) {
+            // start over with a single checkpoint that holds everything
+            tr_debug("Checkpoint region is full, rewriting it");
+            r = start_journal();
+            if (r == 0) {
+                r = write_checkpoint(true);
+            }
+        }
+        if (r != 0) {
+            tr_warn("Writing checkpoint failed (%d)", r);
+            return FRAG_FLASH_WRITE_ERROR;
+        }
+
+        _math.checkpoint_committed();
+        return FRAG_OK;
+    }
+
+    /**
+     * Resume a session from the last checkpoint, instead of starting a new session with initialize().
+     * The session needs to be constructed with the same options, and set up with the same calls to
+     * set_deferred_decoding, set_spill_area and set_checkpoint, as the session that wrote the checkpoints.
+     * Frames that came in after the last checkpoint are treated as lost.
+     *
+     * A session that was interrupted while reconstructing the binary can't be resumed, as the
+     * recovered fragments in flash were already changed.
+     *
+     * @param erase_mode    Same as for initialize(), nothing is erased up front
+     * @param ram_budget    Same as for initialize(), does not need to match the budget of the original session
+     *
+     * @returns FRAG_OK if the session was resumed,
+     *          FRAG_COMPLETE if the session had already completed,
+     *          FRAG_NO_CHECKPOINT if there is no checkpoint for this session, call initialize() to start over,
+     *          FRAG_NO_MEMORY if allocations failed,
+     *          FRAG_FLASH_READ_ERROR if reading the checkpoint failed,
+     *          FRAG_FLASH_WRITE_ERROR if erasing the spill area failed
+     */
+    FragResult resume(FragEraseMode erase_mode = FRAG_ERASE_NONE, size_t ram_budget = 0) {
+        if (_journal.get_size() == 0) return FRAG_NO_CHECKPOINT;
+
+        FragResult result = setup(erase_mode, ram_budget);
+        if (result != FRAG_OK) {
+            return result;
+        }
+
+        FragmentationSessionCheckpoint_t expected, start;
+        FragmentationSessionState_t state;
+        uint16_t type;
+        uint32_t size;
+        bool decoding = false;
+        int r;
+
+        get_checkpoint_start(&expected);
+
+        _journal.rewind();
+        if (_journal.next(&type, &size) != 0 || type != FRAG_CHECKPOINT_START ||
+                _journal.read(&start, sizeof(start)) != 0 || memcmp(&start, &expected, sizeof(start)) != 0) {
+            tr_warn("No checkpoint for this session");
+            return FRAG_NO_CHECKPOINT;
+        }
+
+        // rows spilled after the last checkpoint are lost, the ones in the checkpoints are programmed again
+        if (_spill && erase_mode != FRAG_ERASE_NONE) {
+            r = _flash->erase(_spill_offset, _opts.RedundancyPackets * _opts.FragmentSize);
+            if (r != 0) {
+                tr_warn("Erasing the spill area failed (%d)", r);
+                return FRAG_FLASH_WRITE_ERROR;
+            }
+        }
+
+        // replay the checkpoints in the order they were written
+        while ((r = _journal.next(&type, &size)) == 0) {
+            switch (type) {
+                case FRAG_CHECKPOINT_STATE:
+                    r = _journal.read(&state, sizeof(state));
+                    if (r == 0) {
+                        r = _math.restore(&_journal);
+                    }
+                    if (r == FRAG_CHECKPOINT_END) {
+                        tr_warn("Checkpoint does not match this session");
+                        return FRAG_NO_CHECKPOINT;
+                    }
+                    if (r != 0) {
+                        return FRAG_FLASH_READ_ERROR;
+                    }
+                    _frames_received = state.FramesReceived;
+                    if (state.EraseNext > _erase_next) {
+                        _erase_next = state.EraseNext;
+                    }
+                    break;
+
+                case FRAG_CHECKPOINT_DECODING:
+                    decoding = true;
+                    break;
+
+                case FRAG_CHECKPOINT_COMPLETE:
+                    return FRAG_COMPLETE;
+            }
+        }
+        if (r != FRAG_CHECKPOINT_END) {
+            return FRAG_FLASH_READ_ERROR;
+        }
+
+        if (decoding) {
+            tr_warn("Session was interrupted while decoding, it can't be resumed");
+            return FRAG_NO_CHECKPOINT;
+        }
+
+        tr_debug("Resumed session, %d frames received, %d lost", _frames_received, _math.get_lost_frame_count());
+        return FRAG_OK;
+    }
+
+    /**
+     * Size of a checkpoint with all state of a session, the checkpoint region needs to be at least this big
+     *
+     * @param opts  Options of the session
+     */
+    static size_t get_checkpoint_size(FragmentationSessionOpts_t opts) {
+        size_t row = sizeof(uint16_t) + sizeof(uint8_t) + (FRAG_BITS_TO_WORDS(opts.RedundancyPackets) * sizeof(frag_word_t)) + opts.FragmentSize;
+
+        return (4 * sizeof(frag_checkpoint_header_t))                   // start, state, decoding and complete records
+            + sizeof(FragmentationSessionCheckpoint_t)
+            + sizeof(FragmentationSessionState_t)
+            + sizeof(FragmentationMathCheckpoint_t)
+            + (3 * 2 * sizeof(uint16_t))                                // ranges
+            + (opts.NumberOfFragments * sizeof(uint16_t))               // missing frame index
+            + (2 * opts.RedundancyPackets * sizeof(uint16_t))           // reverse index and stored frames
+            + sizeof(uint16_t) + (opts.RedundancyPackets * row);        // M2 rows
+    }
+
+    /**
+     * Don't process redundancy frames when they come in, but store them in a scratch area in flash
+     * and reconstruct the binary in one pass when enough frames were received. This takes less time per frame,
+     * and frames that turn out to be redundant never cost any flash reads. Call before initialize().
+     *
+     * The scratch area is erased in initialize(), unless the erase mode is FRAG_ERASE_NONE.
+     *
+     * @param scratch_offset    Place in flash for the stored frames, needs RedundancyPackets * FragmentSize bytes
+     *                          and should not overlap with the binary
+     * @param batch_frames      Number of stored frames that are processed per pass over the binary.
+     *                          Takes batch_frames * FragmentSize bytes of RAM. With set_step_decoding,
+     *                          every step() processes one batch until all stored frames are done.
+     */
+    void set_deferred_decoding(size_t scratch_offset, uint16_t batch_frames = FRAG_DEFERRED_BATCH_FRAMES) {
+        _deferred = true;
+        _scratch_offset = scratch_offset;
+        _math.set_deferred(scratch_offset, batch_frames);
+    }
+
+    /**
+     * Keep the fragments that are recovered from redundancy frames, and that don't fit in the RAM budget,
+     * in a spill area in flash while decoding. They are written to their place in the binary once, when they are final.
+     * Flash that needs an erase before it's programmed again (FRAG_ERASE_UPFRONT or FRAG_ERASE_BACKGROUND)
+     * needs this, unless the RAM budget holds RedundancyPackets fragments. Call before initialize().
+     *
+     * The spill area is erased in initialize(), unless the erase mode is FRAG_ERASE_NONE. With checkpoints the
+     * spilled fragments are kept in the checkpoints as well, and the spill area is erased and rewritten in resume().
+     *
+     * @param spill_offset  Place in flash for the fragments, needs RedundancyPackets * FragmentSize bytes
+     *                      and should not overlap with the binary or the scratch area
+     */
+    void set_spill_area(size_t spill_offset) {
+        _spill = true;
+        _spill_offset = spill_offset;
+        _math.set_spill(spill_offset);
+    }
+
+    /**
+     * Use caller-owned scratch space for the buffers that are only used while a frame is processed,
+     * so several sessions can share them (see FragmentationSessionManager). Sessions that share
+     * scratch space must not be called from different threads at the same time. Call before initialize().
+     *
+     * @param scratch   Word-aligned buffer of at least get_scratch_size(opts) bytes
+     */
+    void set_scratch(uint8_t* scratch) {
+        _math.set_scratch(scratch);
+    }
+
+    /**
+     * Size of the scratch space of a session with these options, in bytes
+     */
+    static size_t get_scratch_size(FragmentationSessionOpts_t opts) {
+        return FragmentationMath::get_scratch_size(opts.NumberOfFragments, opts.FragmentSize, opts.RedundancyPackets);
+    }
+
     /**
      * Process a fragmentation frame. Do **not** include the fragindex bytes
      * @param index The index of the frame
      * @param buffer The contents of the frame (without the fragindex bytes)
      * @param size The size of the buffer
      *
-     * @returns FRAG_COMPLETE if the binary was reconstructed,
+     * @returns FRAG_COMPLETE if the binary was reconstructed (and written to flash),
+     *          FRAG_DECODING if enough frames were received, and step() needs to be called to reconstruct the binary,
      *          FRAG_OK if the packet was processed, but the binary was not reconstructed,
      *          FRAG_FLASH_WRITE_ERROR if the packet could not be written to flash
      */
     FragResult process_frame(uint16_t index, uint8_t* buffer, size_t size) {
         if (size != _opts.FragmentSize) return FRAG_SIZE_INCORRECT;
 
+        // already have all the information we need
+        if (_math.is_decoding()) return FRAG_DECODING;
+
         _frames_received++;
 
+        // background erase, one sector per frame
+        if (_erase_next < _erase_end && !erase_until(_erase_next + _flash->get_erase_size())) {
+            return FRAG_FLASH_WRITE_ERROR;
+        }
+
         // the first X packets contain the binary as-is... If that is the case, just store it in flash.
         // index is 1-based
         if (index <= _opts.NumberOfFragments) {
+            if (!erase_until(_opts.FlashOffset + (index * size))) {
+                return FRAG_FLASH_WRITE_ERROR;
+            }
+
             int r = _flash->program(buffer, _opts.FlashOffset + ((index - 1) * size), size);
             if (r != 0) {
                 return FRAG_FLASH_WRITE_ERROR;
@@ -118,26 +502,154 @@ public:
 
             _math.set_frame_found(index);
 
+            if (_verifier) {
+                _verifier->update(index, buffer);
+            }
+
             if (index == _opts.NumberOfFragments && _math.get_lost_frame_count() == 0) {
-                return FRAG_COMPLETE;
+                return complete();
             }
 
             return FRAG_OK;
         }
 
-        // redundancy packet coming in
+        // redundancy packet coming in, recovered fragments can be written anywhere in the binary
+        if (!erase_until(_erase_end)) {
+            return FRAG_FLASH_WRITE_ERROR;
+        }
+
         FragmentationMathSessionParams_t params;
         params.NbOfFrag = _opts.NumberOfFragments;
         params.Redundancy = _opts.RedundancyPackets;
         params.DataSize = _opts.FragmentSize;
         int r = _math.process_redundant_frame(index, buffer, params);
+        if (r == FRAG_SESSION_DECODING) {
+            return FRAG_DECODING;
+        }
         if (r != FRAG_SESSION_ONGOING) {
-            return FRAG_COMPLETE;
+            return complete();
         }
 
         return FRAG_OK;
     }
 
+    /**
+     * Process frames that were received together, e.g. frames that were buffered while the application was busy.
+     * The result is the same as calling process_frame for every frame in ascending order of index, but
+     * runs of consecutive fragments are written to flash with one program operation, and with
+     * set_batch_decoding the redundancy frames are eliminated together.
+     *
+     * @param frames    The frames, in any order
+     * @param count     Number of frames
+     *
+     * @returns FRAG_COMPLETE if the binary was reconstructed (and written to flash), later frames are ignored,
+     *          FRAG_DECODING if enough frames were received, and step() needs to be called to reconstruct the binary,
+     *          FRAG_OK if the frames were processed, but the binary was not reconstructed,
+     *          FRAG_SIZE_INCORRECT if one or more frames had the wrong size (they were skipped),
+     *          FRAG_FLASH_WRITE_ERROR if the frames could not be written to flash
+     */
+    FragResult process_frames(const FragmentationFrame_t* frames, size_t count) {
+        size_t order[FRAG_SESSION_BATCH_FRAMES];
+        FragResult result = FRAG_OK;
+        size_t ix;
+
+        for (ix = 0; ix < count; ix++) {
+            if (frames[ix].Size != _opts.FragmentSize) result = FRAG_SIZE_INCORRECT;
+        }
+
+        // take the frames in order of index (and position for duplicates), a batch of the lowest ones at a time
+        bool first = true;
+        uint16_t last_index = 0;
+        size_t last_ix = 0;
+
+        while (true) {
+            size_t batch = 0;
+
+            for (ix = 0; ix < count; ix++) {
+                uint16_t index = frames[ix].Index;
+
+                if (frames[ix].Size != _opts.FragmentSize) continue;
+                if (!first && (index < last_index || (index == last_index && ix <= last_ix))) continue;
+                if (batch == FRAG_SESSION_BATCH_FRAMES && frames[order[batch - 1]].Index <= index) continue;
+
+                size_t pos = batch < FRAG_SESSION_BATCH_FRAMES ? batch++ : batch - 1;
+                while (pos > 0 && frames[order[pos - 1]].Index > index) {
+                    order[pos] = order[pos - 1];
+                    pos--;
+                }
+                order[pos] = ix;
+            }
+
+            if (batch == 0) break;
+
+            FragResult r = process_batch(frames, order, batch);
+            if (r != FRAG_OK) return r;
+
+            first = false;
+            last_index = frames[order[batch - 1]].Index;
+            last_ix = order[batch - 1];
+        }
+
+        return result;
+    }
+
+    /**
+     * Eliminate up to batch_frames redundancy frames that are passed to process_frames together, so every
+     * fragment that they need is read from flash once for the batch. Takes batch_frames * FragmentSize bytes
+     * of RAM, plus a parity row per frame. The same memory is used to write runs of fragments in one go.
+     * Call before initialize(). Has no effect on redundancy frames with deferred decoding, these cost no reads.
+     *
+     * @param batch_frames  Number of frames that are eliminated together, 0 to process every frame on its own
+     */
+    void set_batch_decoding(uint16_t batch_frames = FRAG_DEFERRED_BATCH_FRAMES) {
+        _math.set_batch(batch_frames);
+    }
+
+    /**
+     * Reconstruct the binary in steps, instead of in the process_frame call that delivers the last required frame.
+     * process_frame then returns FRAG_DECODING, and step() needs to be called until it returns FRAG_COMPLETE.
+     * Call before processing frames.
+     *
+     * @param enabled Whether to decode in steps
+     */
+    void set_step_decoding(bool enabled) {
+        _math.set_resumable(enabled);
+    }
+
+    /**
+     * Continue reconstructing the binary. Every step reads or writes at most `budget` fragments,
+     * so this can be called from idle time without missing the timing of the LoRaWAN stack.
+     *
+     * @param budget Maximum number of row operations (reading or writing a fragment) in this step, at least 1
+     *
+     * @returns FRAG_DECODING if there is more work to do,
+     *          FRAG_COMPLETE if the binary was reconstructed (and written to flash),
+     *          FRAG_OK if there was nothing to decode,
+     *          FRAG_FLASH_WRITE_ERROR if the binary could not be written to flash
+     */
+    FragResult step(int budget) {
+        if (!_math.is_decoding()) return FRAG_OK;
+        if (budget < 1) budget = 1;
+
+        int r = _math.back_substitute(budget);
+        if (r == FRAG_SESSION_DECODING) {
+            return FRAG_DECODING;
+        }
+
+        return complete();
+    }
+
+    /**
+     * Hash the binary while the fragments come in, so that verifying it after FRAG_COMPLETE only
+     * needs to read what the verifier did not see (see FragmentationCrc64::finish and FragmentationSha256::finish).
+     * The verifier is started in initialize(), resume() and reset(), call before these.
+     *
+     * @param verifier  The verifier, or NULL to stop passing fragments to it
+     */
+    void set_verifier(FragmentationVerifier* verifier) {
+        _verifier = verifier;
+    }
+
     /**
      * Convert a FragResult to a string
      */
@@ -147,12 +659,44 @@ public:
             case FRAG_FLASH_WRITE_ERROR: return "Writing to flash failed";
             case FRAG_NO_MEMORY: return "Not enough space on the heap";
             case FRAG_COMPLETE: return "Complete";
+            case FRAG_FLASH_READ_ERROR: return "Reading from flash failed";
+            case FRAG_DECODING: return "Decoding";
+            case FRAG_NO_CHECKPOINT: return "No checkpoint to resume from";
+            case FRAG_NO_SESSION: return "No session for this FragIndex";
 
             case FRAG_OK: return "OK";
             default: return "Unkown FragResult";
         }
     }
 
+    /**
+     * Set the clock that is used to time the decoding phases in get_statistics()
+     *
+     * @param clock Function that returns the current time, e.g. in microseconds
+     */
+    void set_clock(frag_stats_clock_t clock) {
+        _math.set_clock(clock);
+    }
+
+    /**
+     * Get a snapshot of the performance counters of this session: flash operations since initialize(),
+     * the decoding work and the time per phase. All zeros unless FRAG_ENABLE_STATS is set.
+     */
+    FragmentationStats_t get_statistics() {
+        FragmentationStats_t stats = _math.get_statistics();
+#if FRAG_ENABLE_STATS
+        FragmentationStats_t flash = _flash->get_statistics();
+        stats.FlashReads = flash.FlashReads - _flash_stats.FlashReads;
+        stats.FlashPrograms = flash.FlashPrograms - _flash_stats.FlashPrograms;
+        stats.FlashErases = flash.FlashErases - _flash_stats.FlashErases;
+        stats.BytesRead = flash.BytesRead - _flash_stats.BytesRead;
+        stats.BytesProgrammed = flash.BytesProgrammed - _flash_stats.BytesProgrammed;
+        stats.BytesErased = flash.BytesErased - _flash_stats.BytesErased;
+        stats.BytesMapped = flash.BytesMapped - _flash_stats.BytesMapped;
+#endif
+        return stats;
+    }
+
     /**
      * Get the number of lost fragments
      */
@@ -172,11 +716,288 @@ public:
     }
 
 private:
+    /**
+     * Make sure that the flash is erased up to (not including) an address,
+     * by erasing the sectors between the erase position and that address
+     *
+     * @returns true if succeeded, false if erasing failed
+     */
+    bool erase_until(size_t address) {
+        if (address > _erase_end) address = _erase_end;
+        if (_erase_next >= address) return true;
+
+        bd_size_t erase_size = _flash->get_erase_size();
+        size_t end = ((address + erase_size - 1) / erase_size) * erase_size;
+
+        tr_debug("Erasing flash 0x%lx .. 0x%lx", (unsigned long)_erase_next, (unsigned long)end);
+
+        int r = _flash->erase(_erase_next, end - _erase_next);
+        if (r != 0) {
+            tr_warn("Erasing flash failed (%d)", r);
+            return false;
+        }
+
+        _erase_next = end;
+        return true;
+    }
+
+    /**
+     * Process up to FRAG_SESSION_BATCH_FRAMES frames of the right size, see process_frames
+     *
+     * @param frames    The frames
+     * @param order     Positions of the frames in 'frames', in order of index
+     * @param count     Number of frames
+     */
+    FragResult process_batch(const FragmentationFrame_t* frames, const size_t* order, size_t count) {
+        uint16_t counters[FRAG_SESSION_BATCH_FRAMES];
+        uint8_t* data[FRAG_SESSION_BATCH_FRAMES];
+        size_t ix;
+
+        // already have all the information we need
+        if (_math.is_decoding()) return FRAG_DECODING;
+
+        // background erase, one sector per frame
+        for (ix = 0; ix < count; ix++) {
+            _frames_received++;
+
+            if (_erase_next < _erase_end && !erase_until(_erase_next + _flash->get_erase_size())) {
+                return FRAG_FLASH_WRITE_ERROR;
+            }
+        }
+
+        // the first X packets contain the binary as-is, runs of consecutive fragments are written together
+        size_t staging_size;
+        uint8_t* staging = _math.get_batch_buffer(&staging_size);
+
+        ix = 0;
+        while (ix < count && frames[order[ix]].Index <= _opts.NumberOfFragments) {
+            size_t end = ix + 1;
+            while (end < count && frames[order[end]].Index == frames[order[end - 1]].Index + 1 &&
+                    frames[order[end]].Index <= _opts.NumberOfFragments) {
+                end++;
+            }
+
+            uint16_t last = frames[order[end - 1]].Index;
+            if (!erase_until(_opts.FlashOffset + (last * _opts.FragmentSize))) {
+                return FRAG_FLASH_WRITE_ERROR;
+            }
+
+            if (program_run(frames, order + ix, end - ix, staging, staging_size) != 0) {
+                return FRAG_FLASH_WRITE_ERROR;
+            }
+
+            for (; ix < end; ix++) {
+                _math.set_frame_found(frames[order[ix]].Index);
+
+                if (_verifier) {
+                    _verifier->update(frames[order[ix]].Index, frames[order[ix]].Buffer);
+                }
+            }
+
+            if (last == _opts.NumberOfFragments && _math.get_lost_frame_count() == 0) {
+                return complete();
+            }
+        }
+
+        if (ix == count) return FRAG_OK;
+
+        // redundancy packets coming in, recovered fragments can be written anywhere in the binary
+        if (!erase_until(_erase_end)) {
+            return FRAG_FLASH_WRITE_ERROR;
+        }
+
+        size_t coded = 0;
+        for (; ix < count; ix++) {
+            counters[coded] = frames[order[ix]].Index;
+            data[coded] = const_cast<uint8_t*>(frames[order[ix]].Buffer);
+            coded++;
+        }
+
+        FragmentationMathSessionParams_t params;
+        params.NbOfFrag = _opts.NumberOfFragments;
+        params.Redundancy = _opts.RedundancyPackets;
+        params.DataSize = _opts.FragmentSize;
+        int r = _math.process_redundant_frames(counters, data, coded, params);
+        if (r == FRAG_SESSION_DECODING) {
+            return FRAG_DECODING;
+        }
+        if (r != FRAG_SESSION_ONGOING) {
+            return complete();
+        }
+
+        return FRAG_OK;
+    }
+
+    /**
+     * Write a run of consecutive fragments, through the staging buffer if there is one
+     *
+     * @param frames        The frames
+     * @param order         Positions of the fragments of the run in 'frames', in order
+     * @param count         Number of fragments in the run
+     * @param staging       Buffer to put the fragments next to each other, may be NULL
+     * @param staging_size  Size of the staging buffer
+     */
+    int program_run(const FragmentationFrame_t* frames, const size_t* order, size_t count, uint8_t* staging, size_t staging_size) {
+        size_t per_program = staging_size / _opts.FragmentSize;
+
+        for (size_t ix = 0; ix < count; ) {
+            size_t address = _opts.FlashOffset + ((frames[order[ix]].Index - 1) * _opts.FragmentSize);
+
+            if (per_program < 2 || count - ix < 2) {
+                int r = _flash->program(frames[order[ix]].Buffer, address, _opts.FragmentSize);
+                if (r != 0) return r;
+                ix++;
+                continue;
+            }
+
+            size_t n = count - ix;
+            if (n > per_program) n = per_program;
+
+            for (size_t k = 0; k < n; k++) {
+                memcpy(staging + (k * _opts.FragmentSize), frames[order[ix + k]].Buffer, _opts.FragmentSize);
+            }
+
+            int r = _flash->program(staging, address, n * _opts.FragmentSize);
+            if (r != 0) return r;
+            ix += n;
+        }
+
+        return 0;
+    }
+
+    /**
+     * Write the pages that are still in the cache of the block device wrapper to flash
+     */
+    FragResult complete() {
+        if (_flash->sync() != 0) {
+            tr_warn("Could not write cached pages to flash");
+            return FRAG_FLASH_WRITE_ERROR;
+        }
+
+        if (_journal.get_size() > 0) {
+            if (_journal.begin(FRAG_CHECKPOINT_COMPLETE) != 0 || _journal.commit() != 0) {
+                tr_warn("Could not mark the session as complete in the checkpoint");
+            }
+        }
+
+        return FRAG_COMPLETE;
+    }
+
+    /**
+     * Allocate the buffers and set up the erase positions, shared by initialize() and resume()
+     */
+    FragResult setup(FragEraseMode erase_mode, size_t ram_budget) {
+        if (_flash->init() != BD_ERROR_OK) {
+            tr_warn("Could not initialize FragmentationBlockDeviceWrapper");
+            return FRAG_NO_MEMORY;
+        }
+
+#if FRAG_ENABLE_STATS
+        // the wrapper can outlive a session, only count what happens from here
+        _flash_stats = _flash->get_statistics();
+#endif
+
+        _frames_received = 0;
+
+        // fragments beyond the RAM budget are programmed in place twice without a spill area
+        if (erase_mode != FRAG_ERASE_NONE && !_spill &&
+                FRAG_ROW_STORE_RAM_ROWS(ram_budget, (size_t)_opts.RedundancyPackets, (size_t)_opts.FragmentSize) < _opts.RedundancyPackets) {
+            tr_warn("The RAM budget does not hold all recovered fragments, set a spill area when the flash is erased");
+        }
+
+        // initialize the memory required for the Math module
+        if (!_math.initialize(ram_budget)) {
+            tr_warn("Could not initialize FragmentationMath");
+            return FRAG_NO_MEMORY;
+        }
+
+        // a resumed session starts hashing from scratch, the fragments it already has are read back in the end
+        size_t size = (_opts.NumberOfFragments * _opts.FragmentSize) - _opts.Padding;
+        if (_verifier && _verifier->start(_opts.FlashOffset, size, _opts.FragmentSize) != 0) {
+            tr_warn("Could not start the verifier");
+            return FRAG_NO_MEMORY;
+        }
+
+        bd_size_t erase_size = _flash->get_erase_size();
+        size_t end = _opts.FlashOffset + (_opts.NumberOfFragments * _opts.FragmentSize);
+
+        if (erase_mode != FRAG_ERASE_NONE && _opts.FlashOffset % erase_size != 0) {
+            tr_warn("FlashOffset is not aligned to the erase size (%lu), data before it will be erased", (unsigned long)erase_size);
+        }
+
+        _erase_next = (_opts.FlashOffset / erase_size) * erase_size;
+        _erase_end = ((end + erase_size - 1) / erase_size) * erase_size;
+
+        if (erase_mode == FRAG_ERASE_NONE) {
+            _erase_next = _erase_end;
+        }
+
+        return FRAG_OK;
+    }
+
+    void get_checkpoint_start(FragmentationSessionCheckpoint_t *start) {
+        memset(start, 0, sizeof(*start));
+        start->FlashOffset = _opts.FlashOffset;
+        start->ScratchOffset = _deferred ? _scratch_offset : 0xffffffff;
+        start->SpillOffset = _spill ? _spill_offset : 0xffffffff;
+        start->NumberOfFragments = _opts.NumberOfFragments;
+        start->RedundancyPackets = _opts.RedundancyPackets;
+        start->WordBits = FRAG_WORD_BITS;
+        start->FragmentSize = _opts.FragmentSize;
+        start->Padding = _opts.Padding;
+    }
+
+    /**
+     * Erase the checkpoint region, and write the options of this session to it
+     */
+    int start_journal() {
+        FragmentationSessionCheckpoint_t start;
+        get_checkpoint_start(&start);
+
+        int r = _journal.reset();
+        if (r == 0) r = _journal.begin(FRAG_CHECKPOINT_START);
+        if (r == 0) r = _journal.write(&start, sizeof(start));
+        if (r == 0) r = _journal.commit();
+        if (r != 0) {
+            tr_warn("Could not start the checkpoint journal (%d)", r);
+        }
+        return r;
+    }
+
+    int write_checkpoint(bool full) {
+        FragmentationSessionState_t state;
+        state.FramesReceived = _frames_received;
+        state.EraseNext = _erase_next;
+
+        int r = _journal.begin(FRAG_CHECKPOINT_STATE);
+        if (r == 0) r = _journal.write(&state, sizeof(state));
+        if (r == 0) r = _math.checkpoint(&_journal, full);
+        if (r == 0) r = _journal.commit();
+        return r;
+    }
+
     FragmentationBlockDeviceWrapper* _flash;
     FragmentationSessionOpts_t _opts;
     FragmentationMath _math;
 
     uint16_t _frames_received;
+
+    size_t _erase_next; // first address that still needs to be erased
+    size_t _erase_end;  // end of the last sector of the binary
+
+    bool _deferred;         // redundancy frames are stored and processed at the end
+    size_t _scratch_offset; // place in flash where the redundancy frames are stored
+
+    bool _spill;            // recovered fragments beyond the RAM budget are kept in a spill area
+    size_t _spill_offset;   // place in flash of the spill area
+
+    FragmentationCheckpoint _journal; // checkpoints of this session, if set_checkpoint was called
+
+    FragmentationVerifier* _verifier; // hashes the fragments as they come in, if set_verifier was called
+
+#if FRAG_ENABLE_STATS
+    FragmentationStats_t _flash_stats; // counters of the block device wrapper when the session was initialized
+#endif
 };
 
 #endif // _MBEDFRAG_FRAGMENTATION_SESSION_H
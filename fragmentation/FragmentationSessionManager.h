@@ -0,0 +1,244 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_FRAGMENTATION_SESSION_MANAGER_H
+#define _MBEDFRAG_FRAGMENTATION_SESSION_MANAGER_H
+
+#include "mbed.h"
+#include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationSession.h"
+#include <new>
+
+#include "mbed_trace.h"
+#undef TRACE_GROUP
+#define TRACE_GROUP "FMGR"
+
+/**
+ * Number of sessions that can run at the same time, LoRaWAN addresses them with a 2-bit FragIndex
+ */
+#define FRAG_MAX_SESSIONS       4
+
+/**
+ * Runs up to four fragmentation sessions side by side, e.g. a firmware image and a configuration blob.
+ * Frames are routed to a session by their FragIndex. All sessions use the same block device wrapper
+ * (and thus the same cache), and share the scratch space that is only used while a frame is processed.
+ *
+ * The manager checks that the binaries of the sessions don't overlap. The scratch, spill and checkpoint
+ * regions in flash are set up on the sessions after they are created, keeping them apart is up to the caller.
+ * The sessions are not thread-safe, call the manager from one thread.
+ */
+class FragmentationSessionManager {
+public:
+    /**
+     * @param flash         A block device that is wrapped for unaligned operations
+     * @param scratch_size  Size of the shared scratch space, FragmentationSession::get_scratch_size() of the largest session.
+     *                      If 0, it is allocated for the first session and grows whenever no sessions are active.
+     */
+    FragmentationSessionManager(FragmentationBlockDeviceWrapper* flash, size_t scratch_size = 0)
+        : _flash(flash), _scratch(NULL), _scratch_size(0)
+    {
+        for (size_t ix = 0; ix < FRAG_MAX_SESSIONS; ix++) {
+            _sessions[ix] = NULL;
+        }
+
+        if (scratch_size) {
+            grow_scratch(scratch_size);
+        }
+    }
+
+    ~FragmentationSessionManager() {
+        for (uint8_t ix = 0; ix < FRAG_MAX_SESSIONS; ix++) {
+            remove(ix);
+        }
+        free(_scratch);
+    }
+
+    /**
+     * Create a session for a FragIndex, replacing the session that had this index. If the session can't be created,
+     * the session that had this index is kept.
+     * The session can be configured (set_step_decoding, set_deferred_decoding, set_checkpoint, ...)
+     * before it's started through its initialize() or resume() call.
+     *
+     * @param frag_index    FragIndex of the session (0..3)
+     * @param opts          List of options for this session
+     *
+     * @returns the session, or NULL if the index is out of range, the binary overlaps with another session,
+     *          or there was not enough memory
+     */
+    FragmentationSession* create(uint8_t frag_index, FragmentationSessionOpts_t opts) {
+        if (frag_index >= FRAG_MAX_SESSIONS) return NULL;
+
+        // the session that is replaced does not count
+        for (uint8_t ix = 0; ix < FRAG_MAX_SESSIONS; ix++) {
+            if (!_sessions[ix] || ix == frag_index) continue;
+
+            FragmentationSessionOpts_t other = _sessions[ix]->get_options();
+            if (opts.FlashOffset < other.FlashOffset + (other.NumberOfFragments * other.FragmentSize) &&
+                    other.FlashOffset < opts.FlashOffset + (opts.NumberOfFragments * opts.FragmentSize)) {
+                tr_warn("Binary of session %u overlaps with session %u", frag_index, ix);
+                return NULL;
+            }
+        }
+
+        // the scratch space can only move while no other session points into it
+        size_t scratch_size = FragmentationSession::get_scratch_size(opts);
+        bool grow = scratch_size > _scratch_size;
+        if (grow && get_session_count() > (_sessions[frag_index] ? 1 : 0)) {
+            tr_warn("Session %u needs %lu bytes of scratch space, but only has %lu",
+                frag_index, (unsigned long)scratch_size, (unsigned long)_scratch_size);
+            return NULL;
+        }
+
+        FragmentationSession* session = new (std::nothrow) FragmentationSession(_flash, opts);
+        if (!session) {
+            tr_warn("Could not allocate session %u", frag_index);
+            return NULL;
+        }
+
+        // the scratch space is kept if it can't grow
+        if (grow && !grow_scratch(scratch_size)) {
+            delete session;
+            return NULL;
+        }
+
+        remove(frag_index);
+        session->set_scratch(_scratch);
+        _sessions[frag_index] = session;
+        return session;
+    }
+
+    /**
+     * Create a session for a FragIndex and initialize it, see FragmentationSession::initialize
+     *
+     * @returns FRAG_OK if succeeded,
+     *          FRAG_NO_SESSION if the session could not be created,
+     *          any error of FragmentationSession::initialize
+     */
+    FragResult start(uint8_t frag_index, FragmentationSessionOpts_t opts,
+                     FragEraseMode erase_mode = FRAG_ERASE_NONE, size_t ram_budget = 0) {
+        FragmentationSession* session = create(frag_index, opts);
+        if (!session) return FRAG_NO_SESSION;
+
+        return session->initialize(erase_mode, ram_budget);
+    }
+
+    /**
+     * Delete the session of a FragIndex, if there is one
+     */
+    void remove(uint8_t frag_index) {
+        if (frag_index >= FRAG_MAX_SESSIONS) return;
+
+        delete _sessions[frag_index];
+        _sessions[frag_index] = NULL;
+    }
+
+    /**
+     * Get the session of a FragIndex, or NULL if there is none
+     */
+    FragmentationSession* get(uint8_t frag_index) {
+        if (frag_index >= FRAG_MAX_SESSIONS) return NULL;
+
+        return _sessions[frag_index];
+    }
+
+    /**
+     * Number of sessions that exist
+     */
+    uint8_t get_session_count() {
+        uint8_t count = 0;
+        for (size_t ix = 0; ix < FRAG_MAX_SESSIONS; ix++) {
+            if (_sessions[ix]) count++;
+        }
+        return count;
+    }
+
+    /**
+     * Process a frame of a session, see FragmentationSession::process_frame
+     *
+     * @param frag_index    FragIndex of the session
+     * @param index         The index of the frame
+     * @param buffer        The contents of the frame (without the fragindex bytes)
+     * @param size          The size of the buffer
+     *
+     * @returns FRAG_NO_SESSION if there is no session for this FragIndex,
+     *          otherwise the result of FragmentationSession::process_frame
+     */
+    FragResult process_frame(uint8_t frag_index, uint16_t index, uint8_t* buffer, size_t size) {
+        FragmentationSession* session = get(frag_index);
+        if (!session) return FRAG_NO_SESSION;
+
+        return session->process_frame(index, buffer, size);
+    }
+
+    /**
+     * Process the payload of a DataFragment message, that starts with the 16-bit little-endian
+     * FragIndex (upper 2 bits) and fragment index N (lower 14 bits), followed by the fragment.
+     *
+     * @param payload       The payload of the message
+     * @param size          The size of the payload
+     * @param frag_index    Receives the FragIndex of the frame, may be NULL
+     *
+     * @returns FRAG_SIZE_INCORRECT if the payload has no header,
+     *          FRAG_NO_SESSION if there is no session for this FragIndex,
+     *          otherwise the result of FragmentationSession::process_frame
+     */
+    FragResult process_data_fragment(uint8_t* payload, size_t size, uint8_t* frag_index = NULL) {
+        if (size < 2) return FRAG_SIZE_INCORRECT;
+
+        uint16_t index_and_n = payload[0] | (payload[1] << 8);
+        uint8_t index = index_and_n >> 14;
+        if (frag_index) {
+            *frag_index = index;
+        }
+
+        return process_frame(index, index_and_n & 0x3fff, payload + 2, size - 2);
+    }
+
+    /**
+     * Continue reconstructing the binary of a session, see FragmentationSession::step
+     *
+     * @returns FRAG_NO_SESSION if there is no session for this FragIndex,
+     *          otherwise the result of FragmentationSession::step
+     */
+    FragResult step(uint8_t frag_index, int budget) {
+        FragmentationSession* session = get(frag_index);
+        if (!session) return FRAG_NO_SESSION;
+
+        return session->step(budget);
+    }
+
+private:
+    bool grow_scratch(size_t size) {
+        // malloc returns memory that is aligned for any word type
+        uint8_t* scratch = (uint8_t*)realloc(_scratch, size);
+        if (!scratch) {
+            tr_warn("Could not allocate %lu bytes of scratch space", (unsigned long)size);
+            return false;
+        }
+
+        _scratch = scratch;
+        _scratch_size = size;
+        return true;
+    }
+
+    FragmentationBlockDeviceWrapper* _flash;
+    FragmentationSession* _sessions[FRAG_MAX_SESSIONS];
+    uint8_t* _scratch;
+    size_t _scratch_size;
+};
+
+#endif // _MBEDFRAG_FRAGMENTATION_SESSION_MANAGER_H
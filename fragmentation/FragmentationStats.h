@@ -0,0 +1,67 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_FRAGMENTATION_STATS_H
+#define _MBEDFRAG_FRAGMENTATION_STATS_H
+
+#include "mbed.h"
+
+/**
+ * Performance counters of a fragmentation session. Build with FRAG_ENABLE_STATS=1
+ * to record them, otherwise all counting is compiled out and the getters return zeros.
+ *
+ * Times are in ticks of the clock that is passed to FragmentationSession::set_clock,
+ * and stay 0 if no clock is set.
+ */
+#ifndef FRAG_ENABLE_STATS
+#define FRAG_ENABLE_STATS       0
+#endif
+
+typedef struct {
+    // operations on the underlying block device, counted by FragmentationBlockDeviceWrapper
+    uint32_t FlashReads;
+    uint32_t FlashPrograms;
+    uint32_t FlashErases;
+    uint64_t BytesRead;
+    uint64_t BytesProgrammed;
+    uint64_t BytesErased;
+    uint64_t BytesMapped;           // read through FragmentationBlockDeviceWrapper::map, without a copy
+
+    // work done by FragmentationMath
+    uint64_t BytesXored;            // fragment data that was XOR'ed
+    uint32_t ParityRowsGenerated;   // parity rows calculated for redundancy frames
+    uint32_t RedundancyFrames;      // redundancy frames that were processed
+    uint32_t RowsAdded;             // redundancy frames that added a row to the M2 matrix
+
+    // time per phase
+    uint64_t ForwardTime;           // eliminating redundancy frames when they come in
+    uint64_t SolveTime;             // eliminating the stored frames in deferred mode
+    uint64_t BackSubstitutionTime;  // back-substitution, including writing the recovered fragments
+} FragmentationStats_t;
+
+/**
+ * Clock for the phase timing, e.g. a function that returns a microsecond timer
+ */
+typedef uint64_t (*frag_stats_clock_t)(void);
+
+#if FRAG_ENABLE_STATS
+#define FRAG_STATS_ADD(stats, field, value)     ((stats).field += (value))
+#else
+#define FRAG_STATS_ADD(stats, field, value)     do {} while (0)
+#endif
+
+#endif // _MBEDFRAG_FRAGMENTATION_STATS_H
@@ -0,0 +1,55 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_FRAGMENTATION_VERIFIER_H
+#define _MBEDFRAG_FRAGMENTATION_VERIFIER_H
+
+#include "mbed.h"
+
+/**
+ * Hashes a binary while its fragments come in. A verifier that is passed to
+ * FragmentationSession::set_verifier sees every fragment that is written to flash
+ * as it was received, so after FRAG_COMPLETE it only needs to read the parts of
+ * the binary that it did not see (e.g. the fragments that were recovered from
+ * redundancy frames). See FragmentationCrc64 and FragmentationSha256.
+ */
+class FragmentationVerifier {
+public:
+    virtual ~FragmentationVerifier() {}
+
+    /**
+     * Start hashing a binary, called by the session in initialize(), resume() and reset()
+     *
+     * @param address       Offset of the binary in flash
+     * @param size          Size of the binary, without the padding after the last fragment
+     * @param fragment_size Size of a fragment
+     *
+     * @returns 0 if succeeded, -1 if there was not enough memory
+     */
+    virtual int start(uint32_t address, size_t size, uint8_t fragment_size) = 0;
+
+    /**
+     * A fragment was written to flash, called by the session on the thread that processes the frames.
+     * Can be called more than once for the same fragment.
+     *
+     * @param index     The index of the fragment, 1-based
+     * @param buffer    The contents of the fragment, fragment_size bytes
+     */
+    virtual void update(uint16_t index, const uint8_t* buffer) = 0;
+};
+
+#endif // _MBEDFRAG_FRAGMENTATION_VERIFIER_H
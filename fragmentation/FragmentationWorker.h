@@ -0,0 +1,247 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_FRAGMENTATION_WORKER_H
+#define _MBEDFRAG_FRAGMENTATION_WORKER_H
+
+/**
+ * Runs a fragmentation session on its own thread. Frames are copied into a
+ * FragmentationFrameQueue by 'enqueue', which never blocks and can be called
+ * from the radio callback, and the worker thread feeds them to the session.
+ * The flash operations and the decoding thus never hold up the LoRaWAN stack,
+ * and a burst of frames is absorbed by the queue.
+ *
+ * On Mbed OS the worker is an RTOS thread, on a host it's a std::thread.
+ */
+
+#include "mbed.h"
+#include "FragmentationSession.h"
+#include "FragmentationFrameQueue.h"
+
+#if defined(__MBED__)
+#include "rtos.h"
+#else
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#endif
+
+#include "mbed_trace.h"
+#undef TRACE_GROUP
+#define TRACE_GROUP "FWRK"
+
+// Number of frames that can wait for the worker
+#ifndef FRAG_WORKER_QUEUE_FRAMES
+#define FRAG_WORKER_QUEUE_FRAMES    16
+#endif
+
+// Stack size of the worker thread on Mbed OS
+#ifndef FRAG_WORKER_STACK_SIZE
+#define FRAG_WORKER_STACK_SIZE      2048
+#endif
+
+// Row operations per step() call while the worker reconstructs the binary, the stop flag is checked in between
+#define FRAG_WORKER_STEP_BUDGET     16
+
+/**
+ * Called on the worker thread when the session completes, or when processing a frame failed
+ *
+ * @param result    FRAG_COMPLETE, or the error
+ * @param context   The context that was passed to start()
+ */
+typedef void (*frag_worker_callback_t)(FragResult result, void *context);
+
+class FragmentationWorker {
+public:
+    /**
+     * @param session       Initialized session, only the worker thread may call it while the worker runs
+     * @param queue_frames  Number of frames that can wait for the worker
+     */
+    FragmentationWorker(FragmentationSession* session, size_t queue_frames = FRAG_WORKER_QUEUE_FRAMES)
+        : _session(session), _queue(queue_frames, session->get_options().FragmentSize),
+          _callback(NULL), _context(NULL), _running(false), _stop(false), _busy(false)
+#if defined(__MBED__)
+          , _signal(0), _thread(osPriorityNormal, FRAG_WORKER_STACK_SIZE)
+#endif
+    {
+    }
+
+    ~FragmentationWorker() {
+        stop();
+    }
+
+    /**
+     * Start the worker thread
+     *
+     * @param on_result Called when the session completes or fails, may be NULL
+     * @param context   Passed to on_result
+     *
+     * @returns FRAG_OK if the worker runs,
+     *          FRAG_NO_MEMORY if the queue could not be allocated or the thread could not be started
+     */
+    FragResult start(frag_worker_callback_t on_result, void *context = NULL) {
+        if (_running) return FRAG_OK;
+
+        if (!_queue.initialize()) {
+            tr_warn("Could not allocate the frame queue");
+            return FRAG_NO_MEMORY;
+        }
+
+        _callback = on_result;
+        _context = context;
+        _stop = false;
+
+#if defined(__MBED__)
+        if (_thread.start(callback(this, &FragmentationWorker::run)) != osOK) {
+            tr_warn("Could not start the worker thread");
+            return FRAG_NO_MEMORY;
+        }
+#else
+        _thread = std::thread(&FragmentationWorker::run, this);
+#endif
+        _running = true;
+        return FRAG_OK;
+    }
+
+    /**
+     * Stop the worker thread, after the frame or decoding step that it's working on.
+     * Frames that are still queued stay in the queue. On Mbed OS the worker can't be started again.
+     */
+    void stop() {
+        if (!_running) return;
+
+        _stop = true;
+        wake();
+        _thread.join();
+        _running = false;
+    }
+
+    /**
+     * Queue a frame for the worker, never blocks. Call from a single thread or interrupt handler.
+     * Do **not** include the fragindex bytes.
+     *
+     * @param index     The index of the frame
+     * @param buffer    The contents of the frame (without the fragindex bytes), copied into the queue
+     * @param size      The size of the buffer
+     *
+     * @returns true if the frame was queued, false if the queue was full (the frame is dropped, like a lost frame)
+     */
+    bool enqueue(uint16_t index, const uint8_t* buffer, size_t size) {
+        if (!_queue.push(index, buffer, size)) return false;
+
+        wake();
+        return true;
+    }
+
+    /**
+     * Number of frames that were dropped because the queue was full
+     */
+    uint32_t get_dropped_frame_count() {
+        return _queue.get_dropped();
+    }
+
+    /**
+     * Whether the worker has processed all queued frames
+     */
+    bool idle() {
+        return _queue.empty() && !_busy;
+    }
+
+private:
+    void wake() {
+#if defined(__MBED__)
+        _signal.release();
+#else
+        // under the lock, so the notification can't fall between the check in wait() and going to sleep
+        std::lock_guard<std::mutex> lock(_signal_mutex);
+        _signal.notify_one();
+#endif
+    }
+
+    void wait() {
+#if defined(__MBED__)
+        _signal.wait();
+#else
+        std::unique_lock<std::mutex> lock(_signal_mutex);
+        while (!_stop && _queue.empty()) {
+            _signal.wait(lock);
+        }
+#endif
+    }
+
+    void run() {
+        bool done = false;
+
+        while (!_stop) {
+            uint16_t index;
+            uint8_t *buffer;
+            size_t size;
+
+            if (!_queue.front(&index, &buffer, &size)) {
+                wait();
+                continue;
+            }
+
+            // the binary is already reconstructed, later frames are not needed
+            if (done) {
+                _queue.pop();
+                continue;
+            }
+
+            // the frame is read from its slot, so it's only released afterwards
+            _busy = true;
+            FragResult result = _session->process_frame(index, buffer, size);
+            _queue.pop();
+
+            // frames that come in while decoding are queued, and dropped when the session completes
+            while (result == FRAG_DECODING && !_stop) {
+                result = _session->step(FRAG_WORKER_STEP_BUDGET);
+            }
+
+            if (result == FRAG_COMPLETE) {
+                done = true;
+            }
+            if (result != FRAG_OK && result != FRAG_DECODING && _callback) {
+                _callback(result, _context);
+            }
+
+            _busy = false;
+        }
+    }
+
+    FragmentationSession* _session;
+    FragmentationFrameQueue _queue;
+    frag_worker_callback_t _callback;
+    void* _context;
+    bool _running;
+
+#if defined(__MBED__)
+    volatile bool _stop;
+    volatile bool _busy;
+    rtos::Semaphore _signal;
+    rtos::Thread _thread;
+#else
+    std::atomic<bool> _stop;
+    std::atomic<bool> _busy;
+    std::mutex _signal_mutex;
+    std::condition_variable _signal;
+    std::thread _thread;
+#endif
+};
+
+#endif // _MBEDFRAG_FRAGMENTATION_WORKER_H
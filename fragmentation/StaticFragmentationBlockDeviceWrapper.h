@@ -0,0 +1,59 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_STATIC_FRAGMENTATION_BLOCK_DEVICE_WRAPPER_H
+#define _MBEDFRAG_STATIC_FRAGMENTATION_BLOCK_DEVICE_WRAPPER_H
+
+#include "mbed.h"
+#include "FragmentationBlockDeviceWrapper.h"
+
+/**
+ * Block device wrapper that holds its write-back cache in the object itself, so it does not use the heap
+ * (a global or static instance ends up in .bss). Use it together with StaticFragmentationSession.
+ *
+ * @tparam PageSize     Largest page size of the block device, the smallest multiple of its read and program size.
+ *                      init() returns BD_ERROR_NO_MEMORY if the page size of the block device is larger.
+ * @tparam CachePages   Number of pages in the write-back cache
+ */
+template <size_t PageSize, uint8_t CachePages = FRAG_BD_CACHE_PAGES>
+class StaticFragmentationBlockDeviceWrapper : public FragmentationBlockDeviceWrapper {
+public:
+    /**
+     * Bytes of memory that the wrapper holds for its cache
+     */
+    static const size_t CacheSize = FRAG_BD_CACHE_SIZE(PageSize, CachePages);
+
+    /**
+     * Wrap a block device for unaligned operations, note that you still need to initialize this class (by calling 'init')
+     *
+     * @param bd    A block device (can be uninitialized)
+     */
+    StaticFragmentationBlockDeviceWrapper(BlockDevice *bd)
+        : FragmentationBlockDeviceWrapper(bd, CachePages)
+    {
+        set_cache_buffer(reinterpret_cast<uint8_t*>(_storage), sizeof(_storage));
+    }
+
+private:
+    // aligned for the pointers in the cache entries
+    void* _storage[(CacheSize + sizeof(void*) - 1) / sizeof(void*)];
+};
+
+template <size_t PageSize, uint8_t CachePages>
+const size_t StaticFragmentationBlockDeviceWrapper<PageSize, CachePages>::CacheSize;
+
+#endif // _MBEDFRAG_STATIC_FRAGMENTATION_BLOCK_DEVICE_WRAPPER_H
@@ -0,0 +1,98 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_STATIC_FRAGMENTATION_SESSION_H
+#define _MBEDFRAG_STATIC_FRAGMENTATION_SESSION_H
+
+#include "mbed.h"
+#include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationSession.h"
+
+/**
+ * Fragmentation session for a binary that has its size fixed at compile time. All buffers live in
+ * the object itself, so the session does not use the heap (a global or static instance ends up in .bss).
+ * It has the same API as FragmentationSession, and can be used where one is expected. Pair it with a
+ * StaticFragmentationBlockDeviceWrapper, which holds the cache of the block device wrapper the same way.
+ *
+ * Only the buffers are sized at compile time, the decoder loops are not specialized on the template
+ * parameters. They already work on packed words, the per-frame cost is dominated by flash reads, and
+ * templating FragmentationMath would put a copy of the decoder in flash for every configuration.
+ *
+ * @tparam NbFrag               Number of fragments of the binary (FragmentationSessionOpts_t::NumberOfFragments)
+ * @tparam FragSize             Size of a fragment (FragmentationSessionOpts_t::FragmentSize)
+ * @tparam MaxRedundancy        Max. number of redundancy packets (FragmentationSessionOpts_t::RedundancyPackets)
+ * @tparam RamBudget            Largest ram_budget that is passed to initialize() or resume()
+ * @tparam BatchFrames          Batch size for set_deferred_decoding() and set_batch_decoding(), 0 if neither is used
+ */
+template <uint16_t NbFrag, uint8_t FragSize, uint16_t MaxRedundancy, size_t RamBudget = 0, uint16_t BatchFrames = 0>
+class StaticFragmentationSession : public FragmentationSession {
+public:
+    /**
+     * Bytes of memory that the session holds for its buffers, checkpoints are always covered
+     */
+    static const size_t MemorySize =
+          FRAG_MATH_MEMORY_SIZE(NbFrag, FragSize, MaxRedundancy)
+        + (BatchFrames ? FRAG_MATH_DEFERRED_MEMORY_SIZE(NbFrag, FragSize, MaxRedundancy, BatchFrames) : 0)
+        + FRAG_MATH_CHECKPOINT_MEMORY_SIZE(MaxRedundancy)
+        + FRAG_ALIGN_SIZE(FRAG_ROW_STORE_MEMORY_SIZE(RamBudget, MaxRedundancy, FragSize));
+
+    /**
+     * Start a fragmentation session
+     * @param flash         A block device that is wrapped for unaligned operations
+     * @param flash_offset  Place in flash where the final binary needs to be placed
+     * @param padding       Bytes of padding after the last original fragment
+     */
+    StaticFragmentationSession(FragmentationBlockDeviceWrapper* flash, size_t flash_offset, uint8_t padding = 0)
+        : FragmentationSession(flash, get_options(flash_offset, padding))
+    {
+        set_arena(reinterpret_cast<uint8_t*>(_storage), sizeof(_storage));
+    }
+
+    /**
+     * Same as FragmentationSession::set_deferred_decoding, with BatchFrames frames per batch.
+     * initialize() returns FRAG_NO_MEMORY if BatchFrames is 0.
+     */
+    void set_deferred_decoding(size_t scratch_offset) {
+        FragmentationSession::set_deferred_decoding(scratch_offset, BatchFrames);
+    }
+
+    /**
+     * Same as FragmentationSession::set_batch_decoding, with BatchFrames frames per batch
+     */
+    void set_batch_decoding() {
+        FragmentationSession::set_batch_decoding(BatchFrames);
+    }
+
+private:
+    static FragmentationSessionOpts_t get_options(size_t flash_offset, uint8_t padding) {
+        FragmentationSessionOpts_t opts;
+        opts.NumberOfFragments = NbFrag;
+        opts.FragmentSize = FragSize;
+        opts.Padding = padding;
+        opts.RedundancyPackets = MaxRedundancy;
+        opts.FlashOffset = flash_offset;
+        return opts;
+    }
+
+    // word-aligned, like the heap memory of a FragmentationSession
+    frag_word_t _storage[(MemorySize + sizeof(frag_word_t) - 1) / sizeof(frag_word_t)];
+};
+
+template <uint16_t NbFrag, uint8_t FragSize, uint16_t MaxRedundancy, size_t RamBudget, uint16_t BatchFrames>
+const size_t StaticFragmentationSession<NbFrag, FragSize, MaxRedundancy, RamBudget, BatchFrames>::MemorySize;
+
+#endif // _MBEDFRAG_STATIC_FRAGMENTATION_SESSION_H
@@ -0,0 +1,117 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_HOST_FILE_BLOCK_DEVICE_H_
+#define _MBEDFRAG_HOST_FILE_BLOCK_DEVICE_H_
+
+/**
+ * Block device that is backed by a file. The file is created (erased) when
+ * it does not exist yet, and grown to the size of the block device.
+ */
+
+#include "SimulatedBlockDevice.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+class FileBlockDevice : public SimulatedBlockDevice {
+public:
+    /**
+     * @param path      Path to the backing file
+     * @param size      Size of the block device in bytes
+     * @param read      Minimum read size in bytes
+     * @param program   Minimum program size in bytes
+     * @param erase     Minimum erase size in bytes
+     */
+    FileBlockDevice(const char *path, bd_size_t size, bd_size_t read, bd_size_t program, bd_size_t erase)
+        : SimulatedBlockDevice(size, read, program, erase), _path(path), _fd(-1)
+    {
+    }
+
+    virtual ~FileBlockDevice() {
+        deinit();
+    }
+
+    virtual int init() {
+        if (_fd >= 0) return BD_ERROR_OK;
+
+        _fd = open(_path, O_RDWR | O_CREAT, 0644);
+        if (_fd < 0) return BD_ERROR_DEVICE_ERROR;
+
+        return erase_tail(_fd, _size);
+    }
+
+    virtual int deinit() {
+        if (_fd >= 0) {
+            close(_fd);
+            _fd = -1;
+        }
+        return BD_ERROR_OK;
+    }
+
+protected:
+    virtual int read_raw(uint8_t *buffer, bd_addr_t addr, bd_size_t size) {
+        if (_fd < 0) return BD_ERROR_DEVICE_ERROR;
+
+        return pread(_fd, buffer, size, addr) == (ssize_t)size ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+    }
+
+    virtual int program_raw(const uint8_t *buffer, bd_addr_t addr, bd_size_t size) {
+        if (_fd < 0) return BD_ERROR_DEVICE_ERROR;
+
+        return pwrite(_fd, buffer, size, addr) == (ssize_t)size ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+    }
+
+    virtual int erase_raw(bd_addr_t addr, bd_size_t size) {
+        if (_fd < 0) return BD_ERROR_DEVICE_ERROR;
+
+        return fill(_fd, addr, size);
+    }
+
+public:
+    /**
+     * Grow a file to the given size, the new part of the file is erased (0xff)
+     */
+    static int erase_tail(int fd, bd_size_t size) {
+        struct stat st;
+        if (fstat(fd, &st) != 0) return BD_ERROR_DEVICE_ERROR;
+
+        if ((bd_size_t)st.st_size >= size) return BD_ERROR_OK;
+
+        return fill(fd, st.st_size, size - st.st_size);
+    }
+
+private:
+    static int fill(int fd, bd_addr_t addr, bd_size_t size) {
+        uint8_t erased[512];
+        memset(erased, 0xff, sizeof(erased));
+
+        while (size > 0) {
+            size_t length = size > sizeof(erased) ? sizeof(erased) : size;
+            if (pwrite(fd, erased, length, addr) != (ssize_t)length) return BD_ERROR_DEVICE_ERROR;
+
+            addr += length;
+            size -= length;
+        }
+        return BD_ERROR_OK;
+    }
+
+    const char *_path;
+    int _fd;
+};
+
+#endif // _MBEDFRAG_HOST_FILE_BLOCK_DEVICE_H_
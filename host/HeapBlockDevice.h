@@ -0,0 +1,88 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_HOST_HEAP_BLOCK_DEVICE_H_
+#define _MBEDFRAG_HOST_HEAP_BLOCK_DEVICE_H_
+
+/**
+ * Block device that keeps its contents on the heap, starts out erased
+ */
+
+#include "SimulatedBlockDevice.h"
+
+class HeapBlockDevice : public SimulatedBlockDevice {
+public:
+    /**
+     * @param size      Size of the block device in bytes
+     * @param read      Minimum read size in bytes
+     * @param program   Minimum program size in bytes
+     * @param erase     Minimum erase size in bytes
+     */
+    HeapBlockDevice(bd_size_t size, bd_size_t read, bd_size_t program, bd_size_t erase)
+        : SimulatedBlockDevice(size, read, program, erase), _data(NULL)
+    {
+    }
+
+    virtual ~HeapBlockDevice() {
+        deinit();
+    }
+
+    virtual int init() {
+        if (_data) return BD_ERROR_OK;
+
+        _data = (uint8_t*)malloc(_size);
+        if (!_data) return BD_ERROR_DEVICE_ERROR;
+
+        memset(_data, 0xff, _size);
+        return BD_ERROR_OK;
+    }
+
+    virtual int deinit() {
+        if (_data) {
+            free(_data);
+            _data = NULL;
+        }
+        return BD_ERROR_OK;
+    }
+
+protected:
+    virtual int read_raw(uint8_t *buffer, bd_addr_t addr, bd_size_t size) {
+        if (!_data) return BD_ERROR_DEVICE_ERROR;
+
+        memcpy(buffer, _data + addr, size);
+        return BD_ERROR_OK;
+    }
+
+    virtual int program_raw(const uint8_t *buffer, bd_addr_t addr, bd_size_t size) {
+        if (!_data) return BD_ERROR_DEVICE_ERROR;
+
+        memcpy(_data + addr, buffer, size);
+        return BD_ERROR_OK;
+    }
+
+    virtual int erase_raw(bd_addr_t addr, bd_size_t size) {
+        if (!_data) return BD_ERROR_DEVICE_ERROR;
+
+        memset(_data + addr, 0xff, size);
+        return BD_ERROR_OK;
+    }
+
+private:
+    uint8_t *_data;
+};
+
+#endif // _MBEDFRAG_HOST_HEAP_BLOCK_DEVICE_H_
@@ -0,0 +1,115 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_HOST_MMAP_BLOCK_DEVICE_H_
+#define _MBEDFRAG_HOST_MMAP_BLOCK_DEVICE_H_
+
+/**
+ * Block device that maps a file into memory. The file is created (erased)
+ * when it does not exist yet, and grown to the size of the block device.
+ * Changes are written back to the file by the kernel, or on sync().
+ */
+
+#include "SimulatedBlockDevice.h"
+#include "FileBlockDevice.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+class MmapBlockDevice : public SimulatedBlockDevice {
+public:
+    /**
+     * @param path      Path to the backing file
+     * @param size      Size of the block device in bytes
+     * @param read      Minimum read size in bytes
+     * @param program   Minimum program size in bytes
+     * @param erase     Minimum erase size in bytes
+     */
+    MmapBlockDevice(const char *path, bd_size_t size, bd_size_t read, bd_size_t program, bd_size_t erase)
+        : SimulatedBlockDevice(size, read, program, erase), _path(path), _data(NULL)
+    {
+    }
+
+    virtual ~MmapBlockDevice() {
+        deinit();
+    }
+
+    virtual int init() {
+        if (_data) return BD_ERROR_OK;
+
+        int fd = open(_path, O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return BD_ERROR_DEVICE_ERROR;
+
+        if (FileBlockDevice::erase_tail(fd, _size) != BD_ERROR_OK) {
+            close(fd);
+            return BD_ERROR_DEVICE_ERROR;
+        }
+
+        void *data = mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) return BD_ERROR_DEVICE_ERROR;
+
+        _data = static_cast<uint8_t*>(data);
+        return BD_ERROR_OK;
+    }
+
+    virtual int deinit() {
+        if (_data) {
+            munmap(_data, _size);
+            _data = NULL;
+        }
+        return BD_ERROR_OK;
+    }
+
+    virtual int sync() {
+        if (!_data) return BD_ERROR_DEVICE_ERROR;
+
+        return msync(_data, _size, MS_SYNC) == 0 ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+    }
+
+    virtual const uint8_t* get_mapping() const {
+        return _data;
+    }
+
+protected:
+    virtual int read_raw(uint8_t *buffer, bd_addr_t addr, bd_size_t size) {
+        if (!_data) return BD_ERROR_DEVICE_ERROR;
+
+        memcpy(buffer, _data + addr, size);
+        return BD_ERROR_OK;
+    }
+
+    virtual int program_raw(const uint8_t *buffer, bd_addr_t addr, bd_size_t size) {
+        if (!_data) return BD_ERROR_DEVICE_ERROR;
+
+        memcpy(_data + addr, buffer, size);
+        return BD_ERROR_OK;
+    }
+
+    virtual int erase_raw(bd_addr_t addr, bd_size_t size) {
+        if (!_data) return BD_ERROR_DEVICE_ERROR;
+
+        memset(_data + addr, 0xff, size);
+        return BD_ERROR_OK;
+    }
+
+private:
+    const char *_path;
+    uint8_t *_data;
+};
+
+#endif // _MBEDFRAG_HOST_MMAP_BLOCK_DEVICE_H_
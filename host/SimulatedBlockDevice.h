@@ -0,0 +1,195 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_HOST_SIMULATED_BLOCK_DEVICE_H_
+#define _MBEDFRAG_HOST_SIMULATED_BLOCK_DEVICE_H_
+
+/**
+ * Base class for the host block devices. Takes care of the flash geometry
+ * (read, program and erase sizes), checks that every operation is aligned
+ * to it, keeps statistics and can simulate the latency of a real part.
+ *
+ * When strict programming is enabled, program only clears bits (like NOR
+ * flash), so writing to a region that was not erased first corrupts data.
+ */
+
+#include "mbed.h"
+#include "BlockDevice.h"
+#include <time.h>
+
+typedef struct {
+    uint32_t Reads;             // Number of read calls
+    uint32_t Programs;          // Number of program calls
+    uint32_t Erases;            // Number of erase calls
+    uint64_t BytesRead;
+    uint64_t BytesProgrammed;
+    uint64_t BytesErased;
+} SimulatedBlockDeviceStats_t;
+
+class SimulatedBlockDevice : public BlockDevice {
+public:
+    /**
+     * @param size      Size of the block device in bytes
+     * @param read      Minimum read size in bytes
+     * @param program   Minimum program size in bytes
+     * @param erase     Minimum erase size in bytes
+     */
+    SimulatedBlockDevice(bd_size_t size, bd_size_t read, bd_size_t program, bd_size_t erase)
+        : _size(size), _read_size(read), _program_size(program), _erase_size(erase),
+          _read_latency_us(0), _program_latency_us(0), _erase_latency_us(0), _strict_program(false)
+    {
+        reset_statistics();
+    }
+
+    virtual ~SimulatedBlockDevice() {}
+
+    virtual int read(void *buffer, bd_addr_t addr, bd_size_t size) {
+        if (!is_valid_read(addr, size)) return BD_ERROR_DEVICE_ERROR;
+
+        _stats.Reads++;
+        _stats.BytesRead += size;
+        simulate_latency(_read_latency_us, size / _read_size);
+
+        return read_raw(static_cast<uint8_t*>(buffer), addr, size);
+    }
+
+    virtual int program(const void *buffer, bd_addr_t addr, bd_size_t size) {
+        if (!is_valid_program(addr, size)) return BD_ERROR_DEVICE_ERROR;
+
+        _stats.Programs++;
+        _stats.BytesProgrammed += size;
+        simulate_latency(_program_latency_us, size / _program_size);
+
+        if (!_strict_program) {
+            return program_raw(static_cast<const uint8_t*>(buffer), addr, size);
+        }
+
+        // programming can only clear bits
+        uint8_t *current = (uint8_t*)malloc(size);
+        if (!current) return BD_ERROR_DEVICE_ERROR;
+
+        int r = read_raw(current, addr, size);
+        if (r == BD_ERROR_OK) {
+            const uint8_t *data = static_cast<const uint8_t*>(buffer);
+            for (bd_size_t ix = 0; ix < size; ix++) {
+                current[ix] &= data[ix];
+            }
+            r = program_raw(current, addr, size);
+        }
+
+        free(current);
+        return r;
+    }
+
+    virtual int erase(bd_addr_t addr, bd_size_t size) {
+        if (!is_valid_erase(addr, size)) return BD_ERROR_DEVICE_ERROR;
+
+        _stats.Erases++;
+        _stats.BytesErased += size;
+        simulate_latency(_erase_latency_us, size / _erase_size);
+
+        return erase_raw(addr, size);
+    }
+
+    virtual bd_size_t get_read_size() const {
+        return _read_size;
+    }
+
+    virtual bd_size_t get_program_size() const {
+        return _program_size;
+    }
+
+    virtual bd_size_t get_erase_size() const {
+        return _erase_size;
+    }
+
+    virtual bd_size_t get_erase_size(bd_addr_t /* addr */) const {
+        return _erase_size;
+    }
+
+    virtual int get_erase_value() const {
+        return 0xff;
+    }
+
+    virtual bd_size_t size() const {
+        return _size;
+    }
+
+    /**
+     * Simulate the latency of a real part, every operation sleeps for the given
+     * time per read, program or erase unit that it touches
+     */
+    void set_latency(uint32_t read_us, uint32_t program_us, uint32_t erase_us) {
+        _read_latency_us = read_us;
+        _program_latency_us = program_us;
+        _erase_latency_us = erase_us;
+    }
+
+    /**
+     * When enabled, program can only clear bits and erase is required to set them again
+     */
+    void set_strict_program(bool strict) {
+        _strict_program = strict;
+    }
+
+    /**
+     * Address where the contents of the block device can be read directly, for
+     * FragmentationBlockDeviceWrapper::set_mapping. NULL if it's not mapped or not initialized.
+     */
+    virtual const uint8_t* get_mapping() const {
+        return NULL;
+    }
+
+    SimulatedBlockDeviceStats_t get_statistics() const {
+        return _stats;
+    }
+
+    void reset_statistics() {
+        memset(&_stats, 0, sizeof(_stats));
+    }
+
+protected:
+    virtual int read_raw(uint8_t *buffer, bd_addr_t addr, bd_size_t size) = 0;
+    virtual int program_raw(const uint8_t *buffer, bd_addr_t addr, bd_size_t size) = 0;
+    virtual int erase_raw(bd_addr_t addr, bd_size_t size) = 0;
+
+    bd_size_t _size;
+
+private:
+    void simulate_latency(uint32_t us_per_unit, bd_size_t units) {
+        if (us_per_unit == 0) return;
+
+        uint64_t ns = (uint64_t)us_per_unit * units * 1000;
+        struct timespec ts;
+        ts.tv_sec = ns / 1000000000ULL;
+        ts.tv_nsec = ns % 1000000000ULL;
+        nanosleep(&ts, NULL);
+    }
+
+    bd_size_t _read_size;
+    bd_size_t _program_size;
+    bd_size_t _erase_size;
+
+    uint32_t _read_latency_us;
+    uint32_t _program_latency_us;
+    uint32_t _erase_latency_us;
+    bool _strict_program;
+
+    SimulatedBlockDeviceStats_t _stats;
+};
+
+#endif // _MBEDFRAG_HOST_SIMULATED_BLOCK_DEVICE_H_
@@ -0,0 +1,497 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Benchmarks FragmentationSession::process_frame over a sweep of session
+ * parameters and loss patterns, and writes the results as JSON.
+ *
+ * For every combination of number of fragments, fragment size, redundancy
+ * and loss pattern, a number of sessions is decoded on a HeapBlockDevice.
+ * Frames are encoded up front, so only the decoder is measured.
+ */
+
+#include "mbed.h"
+#include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationEncoder.h"
+#include "FragmentationMath.h"
+#include "FragmentationSession.h"
+#include "HeapBlockDevice.h"
+#include <algorithm>
+#include <getopt.h>
+#include <malloc.h>
+#include <string>
+#include <time.h>
+#include <vector>
+
+// Heap tracking. malloc and friends are wrapped so that the peak heap usage
+// of the decoder can be measured, only allocations made while tracking count.
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#define FRAG_BENCHMARK_HEAP_TRACKING 1
+
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *ptr, size_t size);
+extern "C" void __libc_free(void *ptr);
+
+static bool heap_tracking = false;
+static size_t heap_current = 0;
+static size_t heap_peak = 0;
+
+static void heap_add(void *ptr) {
+    if (!ptr || !heap_tracking) return;
+    heap_current += malloc_usable_size(ptr);
+    if (heap_current > heap_peak) heap_peak = heap_current;
+}
+
+static void heap_remove(void *ptr) {
+    if (!ptr || !heap_tracking) return;
+    size_t size = malloc_usable_size(ptr);
+    heap_current = heap_current > size ? heap_current - size : 0;
+}
+
+extern "C" void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    heap_add(ptr);
+    return ptr;
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+    void *ptr = __libc_calloc(count, size);
+    heap_add(ptr);
+    return ptr;
+}
+
+extern "C" void *realloc(void *ptr, size_t size) {
+    heap_remove(ptr);
+    void *new_ptr = __libc_realloc(ptr, size);
+    heap_add(new_ptr ? new_ptr : ptr);
+    return new_ptr;
+}
+
+extern "C" void free(void *ptr) {
+    heap_remove(ptr);
+    __libc_free(ptr);
+}
+
+static void heap_start() {
+    heap_current = 0;
+    heap_peak = 0;
+    heap_tracking = true;
+}
+
+static size_t heap_stop() {
+    heap_tracking = false;
+    return heap_peak;
+}
+#else
+#define FRAG_BENCHMARK_HEAP_TRACKING 0
+
+static void heap_start() {}
+static size_t heap_stop() { return 0; }
+#endif
+
+enum LossPattern {
+    LOSS_UNIFORM,   // every frame is lost with the same probability
+    LOSS_BURSTY,    // Gilbert-Elliott channel, losses come in bursts
+    LOSS_TAIL       // the last part of the uncoded fragments is lost
+};
+
+static const char *loss_pattern_string(LossPattern pattern) {
+    switch (pattern) {
+        case LOSS_UNIFORM: return "uniform";
+        case LOSS_BURSTY: return "bursty";
+        case LOSS_TAIL: return "tail";
+    }
+    return "unknown";
+}
+
+// mean length of a burst of lost frames in the bursty pattern
+#define FRAG_BENCHMARK_BURST_LENGTH     8.0
+
+static double random_double() {
+    return rand() / (RAND_MAX + 1.0);
+}
+
+/**
+ * Decide which frames get lost, returns one flag per frame (true if lost)
+ */
+static std::vector<bool> make_losses(LossPattern pattern, double loss, size_t fragments, size_t frames) {
+    std::vector<bool> lost(frames, false);
+
+    switch (pattern) {
+        case LOSS_UNIFORM:
+            for (size_t ix = 0; ix < frames; ix++) {
+                lost[ix] = random_double() < loss;
+            }
+            break;
+
+        case LOSS_BURSTY: {
+            // leave the bad state after FRAG_BENCHMARK_BURST_LENGTH frames on average,
+            // and enter it often enough to lose 'loss' of the frames in total
+            double p_bad_to_good = 1.0 / FRAG_BENCHMARK_BURST_LENGTH;
+            double p_good_to_bad = loss >= 1.0 ? 1.0 : (p_bad_to_good * loss) / (1.0 - loss);
+            bool bad = false;
+            for (size_t ix = 0; ix < frames; ix++) {
+                bad = bad ? (random_double() >= p_bad_to_good) : (random_double() < p_good_to_bad);
+                lost[ix] = bad;
+            }
+            break;
+        }
+
+        case LOSS_TAIL: {
+            size_t count = (size_t)(fragments * loss);
+            for (size_t ix = fragments - count; ix < fragments; ix++) {
+                lost[ix] = true;
+            }
+            break;
+        }
+    }
+
+    return lost;
+}
+
+struct BenchmarkConfig {
+    uint16_t fragments;
+    uint8_t fragment_size;
+    uint16_t redundancy;
+    LossPattern pattern;
+    double loss;
+};
+
+struct BenchmarkResult {
+    unsigned int runs;
+    unsigned int completed;
+    unsigned int correct;
+    std::vector<double> frame_us;
+    double completion_max_us;
+    double completion_total_us;
+    uint64_t reads;
+    uint64_t programs;
+    uint64_t bytes_read;
+    uint64_t bytes_programmed;
+    uint64_t bytes_xored;
+    uint64_t forward_us;
+    uint64_t solve_us;
+    uint64_t back_substitution_us;
+    size_t peak_heap;
+};
+
+static double now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000.0) + (ts.tv_nsec / 1000.0);
+}
+
+static uint64_t clock_us() {
+    return (uint64_t)now_us();
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t ix = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[ix];
+}
+
+static bool run_session(const BenchmarkConfig &config, bd_size_t read_size, bd_size_t program_size, bd_size_t erase_size, int cache_pages, size_t ram_budget, bool deferred, BenchmarkResult &result) {
+    size_t image_size = config.fragments * config.fragment_size;
+    std::vector<uint8_t> image(image_size);
+    for (size_t ix = 0; ix < image_size; ix++) {
+        image[ix] = rand() & 0xff;
+    }
+
+    FragmentationEncoderOpts_t encoder_opts;
+    encoder_opts.FragmentSize = config.fragment_size;
+    encoder_opts.RedundancyPackets = config.redundancy;
+    encoder_opts.Threads = 1;
+
+    std::vector<uint8_t> frames;
+    FragmentationEncoder encoder(encoder_opts);
+    if (encoder.encode(&image[0], image_size, [&frames](uint16_t, const uint8_t *frame, size_t size) {
+        frames.insert(frames.end(), frame, frame + size);
+    }) != FRAG_OK) {
+        return false;
+    }
+
+    FragmentationSessionOpts_t opts = encoder.get_session_options(0);
+    size_t frame_count = opts.NumberOfFragments + opts.RedundancyPackets;
+    std::vector<bool> lost = make_losses(config.pattern, config.loss, opts.NumberOfFragments, frame_count);
+
+    bd_size_t bd_size = ((image_size + erase_size - 1) / erase_size) * erase_size;
+
+    // in deferred mode the redundancy frames are stored in the sectors after the image
+    size_t scratch_offset = bd_size;
+    if (deferred) {
+        bd_size += ((opts.RedundancyPackets * opts.FragmentSize + erase_size - 1) / erase_size) * erase_size;
+    }
+    HeapBlockDevice bd(bd_size, read_size, program_size, erase_size);
+    if (bd.init() != BD_ERROR_OK) return false;
+
+    // allocated up front, so they do not count towards the heap usage of the decoder
+    std::vector<double> frame_us;
+    frame_us.reserve(frame_count);
+    std::vector<uint8_t> decoded(image_size);
+
+    heap_start();
+
+    FragResult r = FRAG_OK;
+    double completion_us = 0;
+    {
+        FragmentationBlockDeviceWrapper flash(&bd, cache_pages);
+        FragmentationSession session(&flash, opts);
+        if (deferred) {
+            session.set_deferred_decoding(scratch_offset);
+        }
+        if (session.initialize(FRAG_ERASE_NONE, ram_budget) != FRAG_OK) {
+            heap_stop();
+            return false;
+        }
+        session.set_clock(clock_us);
+        bd.reset_statistics();
+
+        for (size_t index = 1; index <= frame_count; index++) {
+            if (lost[index - 1]) continue;
+
+            double start = now_us();
+            r = session.process_frame(index, &frames[(index - 1) * config.fragment_size], config.fragment_size);
+            double elapsed = now_us() - start;
+
+            frame_us.push_back(elapsed);
+            if (r == FRAG_COMPLETE) {
+                completion_us = elapsed;
+                break;
+            }
+            if (r != FRAG_OK) break;
+        }
+
+        FragmentationStats_t session_stats = session.get_statistics();
+        result.bytes_xored += session_stats.BytesXored;
+        result.forward_us += session_stats.ForwardTime;
+        result.solve_us += session_stats.SolveTime;
+        result.back_substitution_us += session_stats.BackSubstitutionTime;
+
+        if (r == FRAG_COMPLETE) {
+            flash.read(&decoded[0], opts.FlashOffset, image_size);
+            if (decoded == image) result.correct++;
+        }
+    }
+
+    size_t peak_heap = heap_stop();
+
+    SimulatedBlockDeviceStats_t stats = bd.get_statistics();
+
+    result.runs++;
+    result.frame_us.insert(result.frame_us.end(), frame_us.begin(), frame_us.end());
+    result.reads += stats.Reads;
+    result.programs += stats.Programs;
+    result.bytes_read += stats.BytesRead;
+    result.bytes_programmed += stats.BytesProgrammed;
+    if (peak_heap > result.peak_heap) result.peak_heap = peak_heap;
+
+    if (r == FRAG_COMPLETE) {
+        result.completed++;
+        result.completion_total_us += completion_us;
+        if (completion_us > result.completion_max_us) result.completion_max_us = completion_us;
+    }
+
+    return true;
+}
+
+static std::vector<unsigned long> parse_list(const char *list) {
+    std::vector<unsigned long> values;
+    const char *p = list;
+    while (*p) {
+        char *end;
+        values.push_back(strtoul(p, &end, 0));
+        if (end == p) break;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return values;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --fragments LIST        Number of fragments (default: 100,500,1000)\n"
+        "  --fragment-sizes LIST   Fragment sizes (default: 50,204)\n"
+        "  --redundancy LIST       Redundancy as percentage of the number of fragments (default: 30,60)\n"
+        "  --patterns LIST         Loss patterns: uniform, bursty, tail (default: all)\n"
+        "  --loss P                Fraction of frames that is lost, 0..1 (default: 0.1)\n"
+        "  --runs N                Sessions per configuration (default: 3)\n"
+        "  --seed N                Random seed (default: 1)\n"
+        "  --read-size N           Read size of the block device (default: 256)\n"
+        "  --program-size N        Program size of the block device (default: 256)\n"
+        "  --erase-size N          Erase size of the block device (default: 4096)\n"
+        "  --ram-budget N          Bytes of RAM for recovered fragments (default: 0)\n"
+        "  --cache-pages N         Pages in the write-back cache of the wrapper (default: 1)\n"
+        "  --deferred              Store redundancy frames and decode them at the end\n"
+        "  --label TEXT            Label stored in the output, e.g. the library version\n"
+        "  --output FILE           Write the JSON results to a file instead of stdout\n",
+        name);
+}
+
+int main(int argc, char **argv) {
+    std::vector<unsigned long> fragments = parse_list("100,500,1000");
+    std::vector<unsigned long> fragment_sizes = parse_list("50,204");
+    std::vector<unsigned long> redundancy = parse_list("30,60");
+    std::vector<LossPattern> patterns;
+    patterns.push_back(LOSS_UNIFORM);
+    patterns.push_back(LOSS_BURSTY);
+    patterns.push_back(LOSS_TAIL);
+    double loss = 0.1;
+    unsigned int runs = 3;
+    unsigned int seed = 1;
+    bd_size_t read_size = 256, program_size = 256, erase_size = 4096;
+    int cache_pages = 1;
+    size_t ram_budget = 0;
+    bool deferred = false;
+    const char *label = "";
+    const char *output = NULL;
+
+    static const struct option options[] = {
+        { "fragments",      required_argument, NULL, 'n' },
+        { "fragment-sizes", required_argument, NULL, 'f' },
+        { "redundancy",     required_argument, NULL, 'r' },
+        { "patterns",       required_argument, NULL, 'p' },
+        { "loss",           required_argument, NULL, 'l' },
+        { "runs",           required_argument, NULL, 'N' },
+        { "seed",           required_argument, NULL, 'S' },
+        { "read-size",      required_argument, NULL, 'R' },
+        { "program-size",   required_argument, NULL, 'P' },
+        { "erase-size",     required_argument, NULL, 'E' },
+        { "cache-pages",    required_argument, NULL, 'c' },
+        { "ram-budget",     required_argument, NULL, 'm' },
+        { "deferred",       no_argument,       NULL, 'd' },
+        { "label",          required_argument, NULL, 'L' },
+        { "output",         required_argument, NULL, 'o' },
+        { "help",           no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (c) {
+            case 'n': fragments = parse_list(optarg); break;
+            case 'f': fragment_sizes = parse_list(optarg); break;
+            case 'r': redundancy = parse_list(optarg); break;
+            case 'p': {
+                patterns.clear();
+                std::string list(optarg);
+                if (list.find("uniform") != std::string::npos) patterns.push_back(LOSS_UNIFORM);
+                if (list.find("bursty") != std::string::npos) patterns.push_back(LOSS_BURSTY);
+                if (list.find("tail") != std::string::npos) patterns.push_back(LOSS_TAIL);
+                break;
+            }
+            case 'l': loss = atof(optarg); break;
+            case 'N': runs = strtoul(optarg, NULL, 0); break;
+            case 'S': seed = strtoul(optarg, NULL, 0); break;
+            case 'R': read_size = strtoull(optarg, NULL, 0); break;
+            case 'P': program_size = strtoull(optarg, NULL, 0); break;
+            case 'E': erase_size = strtoull(optarg, NULL, 0); break;
+            case 'c': cache_pages = atoi(optarg); break;
+            case 'm': ram_budget = strtoul(optarg, NULL, 0); break;
+            case 'd': deferred = true; break;
+            case 'L': label = optarg; break;
+            case 'o': output = optarg; break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    FILE *out = stdout;
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            fprintf(stderr, "Could not open %s\n", output);
+            return 2;
+        }
+    }
+
+    srand(seed);
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"label\": \"%s\",\n", label);
+    fprintf(out, "  \"seed\": %u,\n", seed);
+    fprintf(out, "  \"runs\": %u,\n", runs);
+    fprintf(out, "  \"block_device\": { \"read_size\": %llu, \"program_size\": %llu, \"erase_size\": %llu, \"cache_pages\": %d },\n",
+        (unsigned long long)read_size, (unsigned long long)program_size, (unsigned long long)erase_size, cache_pages);
+    fprintf(out, "  \"ram_budget\": %lu,\n", (unsigned long)ram_budget);
+    fprintf(out, "  \"deferred\": %s,\n", deferred ? "true" : "false");
+    fprintf(out, "  \"heap_tracking\": %s,\n", FRAG_BENCHMARK_HEAP_TRACKING ? "true" : "false");
+    fprintf(out, "  \"statistics\": %s,\n", FRAG_ENABLE_STATS ? "true" : "false");
+    fprintf(out, "  \"results\": [");
+
+    bool first = true;
+    int failures = 0;
+
+    for (size_t n = 0; n < fragments.size(); n++) {
+        for (size_t f = 0; f < fragment_sizes.size(); f++) {
+            for (size_t r = 0; r < redundancy.size(); r++) {
+                for (size_t p = 0; p < patterns.size(); p++) {
+                    BenchmarkConfig config;
+                    config.fragments = fragments[n];
+                    config.fragment_size = fragment_sizes[f];
+                    config.redundancy = (fragments[n] * redundancy[r]) / 100;
+                    config.pattern = patterns[p];
+                    config.loss = loss;
+
+                    BenchmarkResult result = BenchmarkResult();
+                    for (unsigned int run = 0; run < runs; run++) {
+                        if (!run_session(config, read_size, program_size, erase_size, cache_pages, ram_budget, deferred, result)) {
+                            fprintf(stderr, "Could not set up session (%u fragments of %u bytes)\n", config.fragments, config.fragment_size);
+                            failures++;
+                        }
+                    }
+
+                    // every session that completes should have decoded the image correctly
+                    if (result.correct != result.completed) failures++;
+
+                    std::sort(result.frame_us.begin(), result.frame_us.end());
+                    double runs_done = result.runs ? result.runs : 1;
+
+                    fprintf(out, "%s\n    {\n", first ? "" : ",");
+                    fprintf(out, "      \"fragments\": %u, \"fragment_size\": %u, \"redundancy\": %u, \"pattern\": \"%s\", \"loss\": %.3f,\n",
+                        config.fragments, config.fragment_size, config.redundancy, loss_pattern_string(config.pattern), config.loss);
+                    fprintf(out, "      \"runs\": %u, \"completed\": %u, \"correct\": %u,\n", result.runs, result.completed, result.correct);
+                    fprintf(out, "      \"frames\": %lu,\n", (unsigned long)result.frame_us.size());
+                    fprintf(out, "      \"frame_latency_us\": { \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"max\": %.2f },\n",
+                        percentile(result.frame_us, 0.5), percentile(result.frame_us, 0.9),
+                        percentile(result.frame_us, 0.99), percentile(result.frame_us, 1.0));
+                    fprintf(out, "      \"completion_latency_us\": { \"mean\": %.2f, \"max\": %.2f },\n",
+                        result.completed ? result.completion_total_us / result.completed : 0.0, result.completion_max_us);
+                    fprintf(out, "      \"flash_per_session\": { \"reads\": %.1f, \"programs\": %.1f, \"bytes_read\": %.1f, \"bytes_programmed\": %.1f },\n",
+                        result.reads / runs_done, result.programs / runs_done,
+                        result.bytes_read / runs_done, result.bytes_programmed / runs_done);
+                    fprintf(out, "      \"bytes_xored_per_session\": %.1f,\n", result.bytes_xored / runs_done);
+                    fprintf(out, "      \"phase_time_us\": { \"forward\": %.1f, \"solve\": %.1f, \"back_substitution\": %.1f },\n",
+                        result.forward_us / runs_done, result.solve_us / runs_done, result.back_substitution_us / runs_done);
+                    fprintf(out, "      \"peak_heap_bytes\": %lu\n", (unsigned long)result.peak_heap);
+                    fprintf(out, "    }");
+                    fflush(out);
+
+                    first = false;
+                }
+            }
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+
+    if (out != stdout) fclose(out);
+
+    return failures ? 1 : 0;
+}
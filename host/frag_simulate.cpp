@@ -0,0 +1,538 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * Runs a full fragmentation session on the host: encodes an image, drops
+ * frames, decodes it through FragmentationSession on a simulated block device
+ * and checks the result. Meant as a target for perf, sanitizers and cachegrind.
+ */
+
+#include "mbed.h"
+#include "mbed_trace.h"
+#include "FragmentationBlockDeviceWrapper.h"
+#include "FragmentationCrc64.h"
+#include "FragmentationEncoder.h"
+#include "FragmentationMath.h"
+#include "FragmentationSession.h"
+#include "FragmentationWorker.h"
+#if FRAG_MBEDTLS
+#include "FragmentationManifest.h"
+#include "FragmentationSha256.h"
+#endif
+#include "FileBlockDevice.h"
+#include "HeapBlockDevice.h"
+#include "MmapBlockDevice.h"
+#include <atomic>
+#include <getopt.h>
+#include <memory>
+#include <thread>
+#include <time.h>
+#include <vector>
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --image FILE            Image to send (default: random image)\n"
+        "  --image-size N          Size of the random image (default: 102400)\n"
+        "  --fragment-size N       Fragment size (default: 204)\n"
+        "  --redundancy N          Number of redundancy frames (default: 200)\n"
+        "  --loss P                Probability that a frame is lost, 0..1 (default: 0.1)\n"
+        "  --seed N                Seed for the image and the lost frames (default: 1)\n"
+        "  --backend B             heap, file or mmap (default: heap)\n"
+        "  --path FILE             Backing file for the file and mmap backends (default: frag-simulate.bin)\n"
+        "  --read-size N           Read size of the block device (default: 256)\n"
+        "  --program-size N        Program size of the block device (default: 256)\n"
+        "  --erase-size N          Erase size of the block device (default: 4096)\n"
+        "  --latency R,P,E         Latency in us per read, program and erase unit (default: 0,0,0)\n"
+        "  --strict                Program can only clear bits, like NOR flash\n"
+        "  --erase MODE            Erase the flash area: none, upfront or background (default: none)\n"
+        "  --ram-budget N          Bytes of RAM for recovered fragments (default: 0)\n"
+        "  --cache-pages N         Pages in the write-back cache of the wrapper (default: 1)\n"
+        "  --deferred              Store redundancy frames after the image and decode them at the end\n"
+        "  --batch N               Frames per pass over the image in deferred mode or with --burst (default: 8)\n"
+        "  --checkpoint N          Write a checkpoint every N received frames (default: 0, no checkpoints)\n"
+        "  --reboot-at N           Reboot after frame N and resume from the last checkpoint\n"
+        "  --step N                Decode in steps of at most N row operations (default: 0, in one go)\n"
+        "  --async N               Hand frames to a decoder thread through a queue of N frames\n"
+        "  --burst N               Hand frames to the session N at a time, and eliminate redundancy frames together\n"
+        "  --verify V              Hash the image while it comes in: crc64, sha256 or manifest (default: crc64),\n"
+        "                          sha256 and manifest need a build with -DFRAG_MBEDTLS=ON\n"
+        "  --chunk-size N          Chunk size of the manifest (default: 4096)\n"
+        "  --verbose               Enable debug tracing\n",
+        name);
+}
+
+static void on_worker_result(FragResult result, void *context) {
+    static_cast<std::atomic<int>*>(context)->store(result);
+}
+
+static uint64_t clock_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t)now.tv_sec * 1000000) + (now.tv_nsec / 1000);
+}
+
+#if FRAG_MBEDTLS
+static void sha256(const uint8_t *data, size_t size, unsigned char output[32]) {
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts(&ctx, false /* is224 */);
+    mbedtls_sha256_update(&ctx, data, size);
+    mbedtls_sha256_finish(&ctx, output);
+    mbedtls_sha256_free(&ctx);
+}
+#endif
+
+static double elapsed_ms(const struct timespec &start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((now.tv_sec - start.tv_sec) * 1000.0) + ((now.tv_nsec - start.tv_nsec) / 1000000.0);
+}
+
+int main(int argc, char **argv) {
+    const char *image_path = NULL;
+    size_t image_size = 102400;
+    int fragment_size = 204;
+    int redundancy = 200;
+    double loss = 0.1;
+    unsigned int seed = 1;
+    const char *backend = "heap";
+    const char *path = "frag-simulate.bin";
+    bd_size_t read_size = 256, program_size = 256, erase_size = 4096;
+    unsigned int read_us = 0, program_us = 0, erase_us = 0;
+    bool strict = false;
+    int cache_pages = 1;
+    FragEraseMode erase_mode = FRAG_ERASE_NONE;
+    size_t ram_budget = 0;
+    int step_budget = 0;
+    bool deferred = false;
+    unsigned int checkpoint_interval = 0;
+    size_t reboot_at = 0;
+    int batch_frames = FRAG_DEFERRED_BATCH_FRAMES;
+    size_t async_frames = 0;
+    size_t burst_frames = 0;
+    const char *verify = "crc64";
+    size_t chunk_size = 4096;
+
+    static const struct option options[] = {
+        { "image",          required_argument, NULL, 'i' },
+        { "image-size",     required_argument, NULL, 's' },
+        { "fragment-size",  required_argument, NULL, 'f' },
+        { "redundancy",     required_argument, NULL, 'r' },
+        { "loss",           required_argument, NULL, 'l' },
+        { "seed",           required_argument, NULL, 'S' },
+        { "backend",        required_argument, NULL, 'b' },
+        { "path",           required_argument, NULL, 'p' },
+        { "read-size",      required_argument, NULL, 'R' },
+        { "program-size",   required_argument, NULL, 'P' },
+        { "erase-size",     required_argument, NULL, 'E' },
+        { "latency",        required_argument, NULL, 't' },
+        { "strict",         no_argument,       NULL, 'x' },
+        { "cache-pages",    required_argument, NULL, 'c' },
+        { "erase",          required_argument, NULL, 'e' },
+        { "ram-budget",     required_argument, NULL, 'm' },
+        { "step",           required_argument, NULL, 'k' },
+        { "deferred",       no_argument,       NULL, 'd' },
+        { "checkpoint",     required_argument, NULL, 'C' },
+        { "reboot-at",      required_argument, NULL, 'X' },
+        { "batch",          required_argument, NULL, 'B' },
+        { "async",          required_argument, NULL, 'a' },
+        { "burst",          required_argument, NULL, 'u' },
+        { "verify",         required_argument, NULL, 'V' },
+        { "chunk-size",     required_argument, NULL, 'K' },
+        { "verbose",        no_argument,       NULL, 'v' },
+        { "help",           no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int c;
+    while ((c = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (c) {
+            case 'i': image_path = optarg; break;
+            case 's': image_size = strtoul(optarg, NULL, 0); break;
+            case 'f': fragment_size = atoi(optarg); break;
+            case 'r': redundancy = atoi(optarg); break;
+            case 'l': loss = atof(optarg); break;
+            case 'S': seed = strtoul(optarg, NULL, 0); break;
+            case 'b': backend = optarg; break;
+            case 'p': path = optarg; break;
+            case 'R': read_size = strtoull(optarg, NULL, 0); break;
+            case 'P': program_size = strtoull(optarg, NULL, 0); break;
+            case 'E': erase_size = strtoull(optarg, NULL, 0); break;
+            case 't':
+                if (sscanf(optarg, "%u,%u,%u", &read_us, &program_us, &erase_us) != 3) {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'x': strict = true; break;
+            case 'c': cache_pages = atoi(optarg); break;
+            case 'm': ram_budget = strtoul(optarg, NULL, 0); break;
+            case 'k': step_budget = atoi(optarg); break;
+            case 'd': deferred = true; break;
+            case 'C': checkpoint_interval = strtoul(optarg, NULL, 0); break;
+            case 'X': reboot_at = strtoul(optarg, NULL, 0); break;
+            case 'B': batch_frames = atoi(optarg); break;
+            case 'a': async_frames = strtoul(optarg, NULL, 0); break;
+            case 'u': burst_frames = strtoul(optarg, NULL, 0); break;
+            case 'V': verify = optarg; break;
+            case 'K': chunk_size = strtoul(optarg, NULL, 0); break;
+            case 'e':
+                if (strcmp(optarg, "none") == 0) erase_mode = FRAG_ERASE_NONE;
+                else if (strcmp(optarg, "upfront") == 0) erase_mode = FRAG_ERASE_UPFRONT;
+                else if (strcmp(optarg, "background") == 0) erase_mode = FRAG_ERASE_BACKGROUND;
+                else {
+                    usage(argv[0]);
+                    return 2;
+                }
+                break;
+            case 'v': mbed_trace_config_set(TRACE_ACTIVE_LEVEL_ALL); break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+
+    if (fragment_size < 1 || fragment_size > 255 || redundancy < 0 || redundancy > 0xffff) {
+        fprintf(stderr, "Invalid fragment size or redundancy\n");
+        return 2;
+    }
+    if (async_frames > 0 && (checkpoint_interval > 0 || reboot_at > 0)) {
+        fprintf(stderr, "--async can't be combined with --checkpoint or --reboot-at\n");
+        return 2;
+    }
+
+    if (strcmp(verify, "crc64") != 0 && strcmp(verify, "sha256") != 0 && strcmp(verify, "manifest") != 0) {
+        usage(argv[0]);
+        return 2;
+    }
+#if !FRAG_MBEDTLS
+    if (strcmp(verify, "crc64") != 0) {
+        fprintf(stderr, "--verify %s needs a build with -DFRAG_MBEDTLS=ON\n", verify);
+        return 2;
+    }
+#endif
+    if (chunk_size == 0) {
+        fprintf(stderr, "Invalid chunk size\n");
+        return 2;
+    }
+
+    srand(seed);
+
+    // the image
+    std::vector<uint8_t> image;
+    if (image_path) {
+        FILE *file = fopen(image_path, "rb");
+        if (!file) {
+            fprintf(stderr, "Could not open %s\n", image_path);
+            return 2;
+        }
+        uint8_t buffer[4096];
+        size_t length;
+        while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+            image.insert(image.end(), buffer, buffer + length);
+        }
+        fclose(file);
+    }
+    else {
+        image.resize(image_size);
+        for (size_t ix = 0; ix < image.size(); ix++) {
+            image[ix] = rand() & 0xff;
+        }
+    }
+
+    // encode it, frames are indexed 1-based
+    FragmentationEncoderOpts_t encoder_opts;
+    encoder_opts.FragmentSize = fragment_size;
+    encoder_opts.RedundancyPackets = redundancy;
+    encoder_opts.Threads = 0;
+
+    std::vector<uint8_t> frames;
+    FragmentationEncoder encoder(encoder_opts);
+    FragResult result = encoder.encode(&image[0], image.size(), [&frames](uint16_t, const uint8_t *frame, size_t size) {
+        frames.insert(frames.end(), frame, frame + size);
+    });
+    if (result != FRAG_OK) {
+        fprintf(stderr, "Encoding failed: %s\n", FragmentationSession::frag_result_string(result));
+        return 2;
+    }
+
+    FragmentationSessionOpts_t opts = encoder.get_session_options(0);
+    size_t frame_count = opts.NumberOfFragments + opts.RedundancyPackets;
+
+    // block device that holds the image, rounded up to full erase sectors
+    bd_size_t bd_size = ((image.size() + opts.Padding + erase_size - 1) / erase_size) * erase_size;
+
+    // in deferred mode the redundancy frames are stored in the sectors after the image
+    size_t scratch_offset = bd_size;
+    if (deferred) {
+        bd_size += ((opts.RedundancyPackets * opts.FragmentSize + erase_size - 1) / erase_size) * erase_size;
+    }
+
+    // flash that is erased is programmed once, so recovered fragments beyond the RAM budget are spilled after that
+    size_t spill_offset = bd_size;
+    if (erase_mode != FRAG_ERASE_NONE) {
+        bd_size += ((opts.RedundancyPackets * opts.FragmentSize + erase_size - 1) / erase_size) * erase_size;
+    }
+
+    // and the checkpoints after that, with room for a few full checkpoints
+    size_t checkpoint_offset = bd_size;
+    size_t checkpoint_size = ((4 * FragmentationSession::get_checkpoint_size(opts) + erase_size - 1) / erase_size) * erase_size;
+    if (checkpoint_interval > 0) {
+        bd_size += checkpoint_size;
+    }
+
+    // owned here, so every exit path cleans up (and sanitizer runs don't report leaks)
+    std::unique_ptr<SimulatedBlockDevice> bd;
+    if (strcmp(backend, "heap") == 0) {
+        bd.reset(new HeapBlockDevice(bd_size, read_size, program_size, erase_size));
+    }
+    else if (strcmp(backend, "file") == 0) {
+        bd.reset(new FileBlockDevice(path, bd_size, read_size, program_size, erase_size));
+    }
+    else if (strcmp(backend, "mmap") == 0) {
+        bd.reset(new MmapBlockDevice(path, bd_size, read_size, program_size, erase_size));
+    }
+    else {
+        usage(argv[0]);
+        return 2;
+    }
+    bd->set_latency(read_us, program_us, erase_us);
+    bd->set_strict_program(strict);
+
+    // hashes the image while the frames come in
+    uint8_t verify_buffer[512];
+
+#if FRAG_MBEDTLS
+    // the manifest that the signing tooling would send along with the image
+    std::vector<uint8_t> manifest;
+    if (strcmp(verify, "manifest") == 0) {
+        manifest.resize(FragmentationManifestVerify::get_manifest_size(image.size(), chunk_size));
+        FragmentationManifestVerify::create(&image[0], image.size(), chunk_size, &manifest[0]);
+    }
+#endif
+
+    std::unique_ptr<FragmentationBlockDeviceWrapper> flash;
+    std::unique_ptr<FragmentationVerifier> verifier;
+    std::unique_ptr<FragmentationSession> session;
+
+    // set up a new session, or resume one like after a reboot, anything that was not synced is lost
+    auto open_session = [&](bool resume) {
+        session.reset();
+        verifier.reset();
+        flash.reset(new FragmentationBlockDeviceWrapper(bd.get(), cache_pages));
+#if FRAG_MBEDTLS
+        if (strcmp(verify, "sha256") == 0) {
+            verifier.reset(new FragmentationSha256(flash.get(), verify_buffer, sizeof(verify_buffer)));
+        }
+        else if (strcmp(verify, "manifest") == 0) {
+            FragmentationManifestVerify *manifest_verify = new FragmentationManifestVerify(flash.get(), verify_buffer, sizeof(verify_buffer));
+            verifier.reset(manifest_verify);
+            manifest_verify->set_manifest(&manifest[0], manifest.size());
+        }
+        else
+#endif
+        {
+            verifier.reset(new FragmentationCrc64(flash.get(), verify_buffer, sizeof(verify_buffer)));
+        }
+        session.reset(new FragmentationSession(flash.get(), opts));
+        session->set_verifier(verifier.get());
+        if (deferred) {
+            session->set_deferred_decoding(scratch_offset, batch_frames);
+        }
+        else if (burst_frames > 0) {
+            session->set_batch_decoding(batch_frames);
+        }
+        if (erase_mode != FRAG_ERASE_NONE) {
+            session->set_spill_area(spill_offset);
+        }
+        if (checkpoint_interval > 0) {
+            session->set_checkpoint(checkpoint_offset, checkpoint_size);
+        }
+        session->set_step_decoding(step_budget > 0);
+        session->set_clock(clock_us);
+
+        FragResult r = resume ? session->resume(erase_mode, ram_budget) : session->initialize(erase_mode, ram_budget);
+
+        // the mmap backend is mapped once it's initialized, the verifiers then hash from it without a copy
+        flash->set_mapping(bd->get_mapping());
+        return r;
+    };
+
+    result = open_session(false);
+    if (result != FRAG_OK) {
+        fprintf(stderr, "Initializing session failed: %s\n", FragmentationSession::frag_result_string(result));
+        return 2;
+    }
+
+    // decode, the last frame is never lost so every run ends
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // hand the frames to the decoder thread, waiting whenever the queue is full
+    unsigned long queue_full = 0;
+    if (async_frames > 0) {
+        std::atomic<int> worker_result(FRAG_OK);
+        FragmentationWorker worker(session.get(), async_frames);
+        result = worker.start(on_worker_result, &worker_result);
+        if (result != FRAG_OK) {
+            fprintf(stderr, "Starting the worker failed: %s\n", FragmentationSession::frag_result_string(result));
+            return 2;
+        }
+
+        for (size_t index = 1; index <= frame_count && worker_result == FRAG_OK; index++) {
+            if (index != frame_count && (rand() / (RAND_MAX + 1.0)) < loss) continue;
+
+            while (!worker.enqueue(index, &frames[(index - 1) * fragment_size], fragment_size) && worker_result == FRAG_OK) {
+                queue_full++;
+                std::this_thread::yield();
+            }
+        }
+        while (!worker.idle() && worker_result == FRAG_OK) {
+            std::this_thread::yield();
+        }
+        worker.stop();
+        result = (FragResult)worker_result.load();
+    }
+
+    std::vector<FragmentationFrame_t> burst;
+    uint32_t last_checkpoint = 0;
+    size_t index;
+    for (index = 1; index <= frame_count && async_frames == 0; index++) {
+        if (reboot_at > 0 && index == reboot_at + 1) {
+            // frames that were buffered are lost as well
+            burst.clear();
+            last_checkpoint = 0;
+            result = open_session(true);
+            printf("reboot:      after frame %lu, resume: %s\n", (unsigned long)reboot_at, FragmentationSession::frag_result_string(result));
+            if (result == FRAG_COMPLETE) break;
+            if (result != FRAG_OK) return 1;
+        }
+
+        if (index != frame_count && (rand() / (RAND_MAX + 1.0)) < loss) continue;
+
+        // with --burst, frames are buffered and handed over together
+        if (burst_frames > 0) {
+            FragmentationFrame_t frame = { (uint16_t)index, &frames[(index - 1) * fragment_size], (size_t)fragment_size };
+            burst.push_back(frame);
+            if (burst.size() < burst_frames && index != frame_count) continue;
+
+            result = session->process_frames(&burst[0], burst.size());
+            burst.clear();
+        }
+        else {
+            result = session->process_frame(index, &frames[(index - 1) * fragment_size], fragment_size);
+        }
+        if (result == FRAG_COMPLETE || result == FRAG_DECODING) break;
+        if (result != FRAG_OK) {
+            fprintf(stderr, "Processing frame %lu failed: %s\n", (unsigned long)index, FragmentationSession::frag_result_string(result));
+            return 1;
+        }
+
+        if (checkpoint_interval > 0 && session->get_received_frame_count() - last_checkpoint >= checkpoint_interval) {
+            last_checkpoint = session->get_received_frame_count();
+            result = session->checkpoint();
+            if (result != FRAG_OK) {
+                fprintf(stderr, "Checkpoint failed: %s\n", FragmentationSession::frag_result_string(result));
+                return 1;
+            }
+        }
+    }
+
+    // finish the decode in steps, like an application would do in idle time
+    unsigned int steps = 0;
+    double longest_step_ms = 0;
+    while (result == FRAG_DECODING) {
+        struct timespec step_start;
+        clock_gettime(CLOCK_MONOTONIC, &step_start);
+
+        result = session->step(step_budget);
+
+        double step_ms = elapsed_ms(step_start);
+        if (step_ms > longest_step_ms) longest_step_ms = step_ms;
+        steps++;
+    }
+
+    double decode_ms = elapsed_ms(start);
+    SimulatedBlockDeviceStats_t stats = bd->get_statistics();
+
+    printf("fragments:   %u x %u bytes, %u redundancy frames\n", opts.NumberOfFragments, opts.FragmentSize, opts.RedundancyPackets);
+    printf("received:    %u frames, lost %d fragments\n", session->get_received_frame_count(), session->get_lost_frame_count());
+    printf("decode:      %.3f ms\n", decode_ms);
+    if (step_budget > 0) {
+        printf("steps:       %u, longest %.3f ms\n", steps, longest_step_ms);
+    }
+    if (async_frames > 0) {
+        printf("queue:       %lu times full\n", queue_full);
+    }
+    printf("flash:       %u reads (%llu bytes), %u programs (%llu bytes), %u erases (%llu bytes)\n",
+        stats.Reads, (unsigned long long)stats.BytesRead,
+        stats.Programs, (unsigned long long)stats.BytesProgrammed,
+        stats.Erases, (unsigned long long)stats.BytesErased);
+#if FRAG_ENABLE_STATS
+    FragmentationStats_t session_stats = session->get_statistics();
+    printf("decoder:     %u redundancy frames (%u added a row), %u parity rows, %llu bytes XOR'ed\n",
+        session_stats.RedundancyFrames, session_stats.RowsAdded, session_stats.ParityRowsGenerated,
+        (unsigned long long)session_stats.BytesXored);
+    printf("phases:      forward %.3f ms, solve %.3f ms, back-substitution %.3f ms\n",
+        session_stats.ForwardTime / 1000.0, session_stats.SolveTime / 1000.0, session_stats.BackSubstitutionTime / 1000.0);
+#endif
+
+    if (result != FRAG_COMPLETE) {
+        printf("result:      could not reconstruct the image\n");
+        return 1;
+    }
+
+    uint8_t buffer[512];
+    FragmentationCrc64 crc64_flash(flash.get(), buffer, sizeof(buffer));
+    uint64_t expected = crc64(0, &image[0], image.size());
+    bool streamed_ok;
+
+    // only the parts of the image that the verifier did not see are read back
+    SimulatedBlockDeviceStats_t before = bd->get_statistics();
+#if FRAG_MBEDTLS
+    if (strcmp(verify, "sha256") == 0) {
+        unsigned char expected_hash[32], streamed_hash[32];
+        sha256(&image[0], image.size(), expected_hash);
+        static_cast<FragmentationSha256*>(verifier.get())->finish(streamed_hash);
+        streamed_ok = memcmp(expected_hash, streamed_hash, sizeof(expected_hash)) == 0;
+    }
+    else if (strcmp(verify, "manifest") == 0) {
+        FragmentationManifestVerify *manifest_verify = static_cast<FragmentationManifestVerify*>(verifier.get());
+        size_t checked = 0;
+        for (size_t chunk = 0; chunk < manifest_verify->get_chunk_count(); chunk++) {
+            if (manifest_verify->get_chunk_state(chunk) != FRAG_CHUNK_UNKNOWN) checked++;
+        }
+        streamed_ok = manifest_verify->finish(0);
+        printf("manifest:    %lu of %lu chunks checked before completion\n",
+            (unsigned long)checked, (unsigned long)manifest_verify->get_chunk_count());
+    }
+    else
+#endif
+    {
+        streamed_ok = static_cast<FragmentationCrc64*>(verifier.get())->finish() == expected;
+    }
+    SimulatedBlockDeviceStats_t after = bd->get_statistics();
+
+    uint64_t actual = crc64_flash.calculate(opts.FlashOffset, image.size(), 0);
+
+    printf("verify:      streaming %s %s, read %llu bytes after completion\n", verify, streamed_ok ? "OK" : "MISMATCH",
+        (unsigned long long)(after.BytesRead - before.BytesRead));
+    printf("result:      %s (crc64 %016llx)\n", expected == actual ? "OK" : "MISMATCH", (unsigned long long)actual);
+
+    return expected == actual && streamed_ok ? 0 : 1;
+}
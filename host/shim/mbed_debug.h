@@ -0,0 +1,38 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_HOST_MBED_DEBUG_H_
+#define _MBEDFRAG_HOST_MBED_DEBUG_H_
+
+#include <stdarg.h>
+#include <stdio.h>
+
+/**
+ * Output a debug message to stderr, compiled out when NDEBUG is set (like on target)
+ */
+static inline void debug(const char *format, ...) {
+#if !defined(NDEBUG)
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+#else
+    (void)format;
+#endif
+}
+
+#endif // _MBEDFRAG_HOST_MBED_DEBUG_H_
@@ -0,0 +1,81 @@
+/*
+ * PackageLicenseDeclared: Apache-2.0
+ * Copyright (c) 2018 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MBEDFRAG_HOST_MBED_TRACE_H_
+#define _MBEDFRAG_HOST_MBED_TRACE_H_
+
+/**
+ * Minimal stand-in for mbed-trace. Messages go to stderr, prefixed with the
+ * trace group of the file that logged them. Only warnings and errors are
+ * printed, unless the level is changed with mbed_trace_config_set().
+ */
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_ACTIVE_LEVEL_ALL      0xff
+#define TRACE_ACTIVE_LEVEL_DEBUG    0x1f
+#define TRACE_ACTIVE_LEVEL_INFO     0x0f
+#define TRACE_ACTIVE_LEVEL_WARN     0x07
+#define TRACE_ACTIVE_LEVEL_ERROR    0x03
+#define TRACE_ACTIVE_LEVEL_NONE     0x00
+
+#define TRACE_LEVEL_DEBUG           0x10
+#define TRACE_LEVEL_INFO            0x08
+#define TRACE_LEVEL_WARN            0x04
+#define TRACE_LEVEL_ERROR           0x02
+
+static inline uint8_t *mbed_trace_level() {
+    static uint8_t level = TRACE_ACTIVE_LEVEL_WARN;
+    return &level;
+}
+
+static inline int mbed_trace_init(void) {
+    return 0;
+}
+
+static inline void mbed_trace_config_set(uint8_t config) {
+    *mbed_trace_level() = config;
+}
+
+// checked like printf, so -Wformat catches arguments that don't match the format on the host
+static inline void mbed_tracef(uint8_t dlevel, const char *grp, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+static inline void mbed_tracef(uint8_t dlevel, const char *grp, const char *fmt, ...) {
+    static const char *names[] = { "ERR ", "WARN", "INFO", "DBG " };
+
+    if (!(*mbed_trace_level() & dlevel)) return;
+
+    const char *name = dlevel == TRACE_LEVEL_ERROR ? names[0] :
+                       dlevel == TRACE_LEVEL_WARN ? names[1] :
+                       dlevel == TRACE_LEVEL_INFO ? names[2] : names[3];
+
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "[%s][%-4s]: ", name, grp);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+}
+
+#define tr_debug(...)   mbed_tracef(TRACE_LEVEL_DEBUG, TRACE_GROUP, __VA_ARGS__)
+#define tr_info(...)    mbed_tracef(TRACE_LEVEL_INFO,  TRACE_GROUP, __VA_ARGS__)
+#define tr_warn(...)    mbed_tracef(TRACE_LEVEL_WARN,  TRACE_GROUP, __VA_ARGS__)
+#define tr_error(...)   mbed_tracef(TRACE_LEVEL_ERROR, TRACE_GROUP, __VA_ARGS__)
+
+#endif // _MBEDFRAG_HOST_MBED_TRACE_H_
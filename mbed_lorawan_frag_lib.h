@@ -25,6 +25,7 @@
 #include "FragmentationBlockDeviceWrapper.h"
 #include "FragmentationCrc64.h"
 #include "FragmentationEcdsaVerify.h"
+#include "FragmentationManifest.h"
 #include "FragmentationRsaVerify.h"
 #include "FragmentationSha256.h"
 #include "FragmentationMath.h"